@@ -4,352 +4,1045 @@
 
 #include <linux/slab.h>       /* for kmalloc*/
 #include <linux/string.h>     /* for memset*/
+#include <linux/jhash.h>      /* for jhash */
+#include <linux/errno.h>      /* for the insert_pair error codes */
 #include "key_vault.h"
 
 /* the key vault:  once globally available, but now specified by a parameter */
 // static struct key_vault v;
 
+/* kv_deref:  fetches a pointer that updates publish with rcu_assign_pointer;
+ *            the caller is either under rcu_read_lock() or the updater    */
+#define kv_deref(p)  rcu_dereference_check((p), 1)
+
+/* key_hash:  hashes a key of klen bytes for the per-user key index */
+static u32 key_hash (const char *key, int klen) {
+	return jhash(key, klen, 0);
+}
+
+/* val_hash:  hashes a value of vlen bytes for a chain's value index */
+static u32 val_hash (const char *val, int vlen) {
+	return jhash(val, vlen, 0);
+}
+
+/* key_is:  whether list element l holds the given key */
+static int key_is (const struct kv_list *l, const char *key, int klen) {
+	return l->kv.klen == klen && memcmp(kv_key(l), key, klen) == 0;
+}
+
+/* val_is:  whether list element l holds the given value */
+static int val_is (const struct kv_list *l, const char *val, int vlen) {
+	return l->kv.vlen == vlen && memcmp(kv_val(l), val, vlen) == 0;
+}
+
+/* node_size:  bytes occupied by a list element holding the pair kv */
+static size_t node_size (const struct key_val *kv) {
+	return sizeof(struct kv_list) +
+	       (kv_inline(kv) ? kv->klen + kv->vlen : sizeof(char *));
+}
+
+/* free_node:  returns list element l, and its string buffer, to arena a */
+static void free_node (struct kv_arena *a, struct kv_list *l) {
+	if (!kv_inline(&l->kv)) {
+		kv_arena_free(a, (char *) kv_key(l), l->kv.klen + l->kv.vlen);
+	}
+
+	kv_arena_free(a, l, node_size(&l->kv));
+}
+
+/* keys_bytes:  size of the slots of a key table of the given capacity */
+static size_t keys_bytes (int cap) {
+	return cap * (sizeof(struct kv_head *) + sizeof(u32));
+}
+
+/* user_bytes:  memory held for user's key data: what its arena holds (chunks,
+ *              free objects included, and oversized strings) plus the key
+ *              tables; callers without user->lock must hold rcu_read_lock() */
+static size_t user_bytes (const struct kv_list_h *user) {
+	struct kv_keys  *keys  = kv_deref(user->keys);
+	struct kv_index *index = kv_deref(user->index);
+	size_t           bytes = READ_ONCE(user->arena.held);
+
+	if (keys  != NULL) bytes += keys_bytes(keys->cap);
+	if (index != NULL) bytes += index->size * sizeof(struct kv_islot);
+
+	return bytes;
+}
+
+/* index_lookup:  returns the slot in user->keys holding key, or -1 if the key
+ *                is not present, and sets *hp to the key's chain; hash must be
+ *                key_hash(key, klen).  Safe for readers, who must retry on
+ *                user->seq, since what they see of the tables may be torn   */
+static int index_lookup (struct kv_list_h *user, const char *key, int klen,
+                         u32 hash, struct kv_head **hp) {
+	struct kv_keys  *keys = kv_deref(user->keys);
+	struct kv_index *ix   = kv_deref(user->index);
+	struct kv_head  *h;
+	u32              mask;
+	u32              b;
+	int              k, n;
+
+	/* no key has been added for this user yet */
+	if (keys == NULL) return -1;
+
+	/* a user with few keys has no index; scan the packed hashes, touching a
+	   key's chain only when its hash matches */
+	if (ix == NULL) {
+		n = min(READ_ONCE(user->num_keys), keys->cap);
+		for (k = 0; k < n; k++) {
+			if (keys->hashes[k] == hash &&
+			    (h = kv_deref(keys->heads[k])) != NULL &&
+			    key_is(kv_deref(h->first), key, klen)) {
+				*hp = h;
+				return k;
+			}
+		}
+		return -1;
+	}
+
+	/* probe linearly; the load factor guarantees an empty bucket ends it.  The
+	   index may be newer than keys, so each slot is checked against its size */
+	mask = ix->size - 1;
+	for (b = hash & mask; (k = ix->slot[b].slot) != KV_INDEX_EMPTY;
+	     b = (b+1) & mask) {
+		if (k >= 0 && k < keys->cap && ix->slot[b].hash == hash &&
+		    (h = kv_deref(keys->heads[k])) != NULL &&
+		    key_is(kv_deref(h->first), key, klen)) {
+			*hp = h;
+			return k;
+		}
+	}
+
+	return -1;
+}
+
+/* index_place:  stores (hash, slot) in the first free bucket of its probe
+ *               sequence; returns TRUE if that bucket had never been used    */
+static int index_place (struct kv_index *ix, u32 hash, int slot) {
+	u32 mask = ix->size - 1;
+	u32 b    = hash & mask;
+
+	while (ix->slot[b].slot >= 0) b = (b+1) & mask;
+
+	int fresh         = (ix->slot[b].slot == KV_INDEX_EMPTY);
+	ix->slot[b].hash = hash;
+	ix->slot[b].slot = slot;
+
+	return fresh;
+}
+
+/* index_resize:  the size index_reserve would rehash user's index into, or 0
+ *                if the index can take one more key as it is              */
+static int index_resize (const struct kv_list_h *user) {
+	struct kv_index *old = user->index;
+
+	/* until it outgrows a scan of its hashes, a user needs no index */
+	if (old == NULL && user->num_keys < KV_SCAN_KEYS) return 0;
+
+	if (old != NULL && (old->used+1)*4 <= old->size*3) return 0;
+
+	/* size the new table so that it starts out at most half full */
+	int size = KV_INDEX_MIN;
+	while ((user->num_keys+1)*2 > size) size *= 2;
+
+	return size;
+}
+
+/* index_reserve:  ensures the index can take one more key without exceeding
+ *                 a 3/4 load (tombstones included), rehashing into a larger
+ *                 table when needed; returns FALSE if allocation fails.  The
+ *                 new table maps every key as the old one did, so it is just
+ *                 published, and the old one freed once readers are done   */
+static int index_reserve (struct kv_list_h *user) {
+	struct kv_index *old  = user->index;
+	int              size = index_resize(user);
+
+	if (size == 0) return TRUE;
+
+	struct kv_index *ix = kmalloc(sizeof(struct kv_index) +
+	                              size*sizeof(struct kv_islot), GFP_KERNEL);
+	if (ix == NULL) return FALSE;
+
+	int b, k;
+	ix->size = size;
+	ix->used = user->num_keys;
+	for (b = 0; b < size; b++) ix->slot[b].slot = KV_INDEX_EMPTY;
+
+	/* rehash the live keys, which also discards any tombstones */
+	for (k = 0; k < user->num_keys; k++) {
+		index_place(ix, user->keys->hashes[k], k);
+	}
+
+	rcu_assign_pointer(user->index, ix);
+	if (old != NULL) kfree_rcu(old, rcu);
+
+	return TRUE;
+}
+
+/* index_add:  records that the key with the given hash lives at slot; the
+ *             caller must have called index_reserve first                    */
+static void index_add (struct kv_list_h *user, u32 hash, int slot) {
+	if (user->index == NULL) return;
+
+	if (index_place(user->index, hash, slot)) {
+		user->index->used++;
+	}
+}
+
+/* index_reslot:  moves the key with the given hash from slot "from" to slot
+ *                "to"; passing KV_INDEX_TOMB as "to" removes the key         */
+static void index_reslot (struct kv_list_h *user, u32 hash, int from, int to) {
+	struct kv_index *ix = user->index;
+	u32              mask;
+	u32              b;
+
+	if (ix == NULL) return;
+
+	mask = ix->size - 1;
+	for (b = hash & mask; ix->slot[b].slot != KV_INDEX_EMPTY; b = (b+1) & mask) {
+		if (ix->slot[b].slot == from) {
+			ix->slot[b].slot = to;
+			return;
+		}
+	}
+}
+
+/* vindex_bytes:  size of a value index of the given number of buckets */
+static size_t vindex_bytes (int size) {
+	return sizeof(struct kv_vindex) + size*sizeof(struct kv_vslot);
+}
+
+/* vindex_place:  stores (hash, node) in the first free bucket of its probe
+ *                sequence; returns TRUE if that bucket had never been used.
+ *                The hash is stored first, so a reader that sees the node
+ *                at worst skips it                                          */
+static int vindex_place (struct kv_vindex *vx, u32 hash, struct kv_list *node) {
+	u32 mask = vx->size - 1;
+	u32 b    = hash & mask;
+
+	while (vx->slot[b].node != NULL && vx->slot[b].node != KV_VINDEX_TOMB) {
+		b = (b+1) & mask;
+	}
+
+	int fresh         = (vx->slot[b].node == NULL);
+	vx->slot[b].hash = hash;
+	rcu_assign_pointer(vx->slot[b].node, node);
+
+	return fresh;
+}
+
+/* vindex_drop:  returns chain h's value index (if any) to arena a */
+static void vindex_drop (struct kv_arena *a, struct kv_head *h) {
+	struct kv_vindex *vx = h->vindex;
+
+	if (vx == NULL) return;
+
+	RCU_INIT_POINTER(h->vindex, NULL);
+	kv_arena_free(a, vx, vindex_bytes(vx->size));
+}
+
+/* vindex_resize:  the size vindex_add would (re)build chain h's value index
+ *                 at once the chain holds n values, or 0 if it would not   */
+static int vindex_resize (const struct kv_head *h, int n) {
+	struct kv_vindex *vx = h->vindex;
+
+	/* a short chain is not indexed, and an index is rebuilt at 3/4 load
+	   (tombstones included) */
+	if (vx == NULL ? n < KV_VINDEX_MIN : (vx->used+1)*4 <= vx->size*3) return 0;
+
+	/* sized to start out at most half full */
+	int size = KV_INDEX_MIN;
+	while (n*2 > size) size *= 2;
+
+	return size;
+}
+
+/* vindex_build:  (re)builds the value index of chain h from the chain itself,
+ *                sized to start out at most half full; on failure the old
+ *                index is left as it was and FALSE is returned              */
+static int vindex_build (struct kv_arena *a, struct kv_head *h) {
+	int size = KV_INDEX_MIN;
+	while (h->num_vals*2 > size) size *= 2;
+
+	struct kv_vindex *vx = kv_arena_alloc(a, vindex_bytes(size));
+	if (vx == NULL) return FALSE;
+
+	memset(vx, 0, vindex_bytes(size));
+	vx->size = size;
+	vx->used = h->num_vals;
+
+	struct kv_list *l;
+	for (l = h->first; l != NULL; l = l->next) {
+		vindex_place(vx, val_hash(kv_val(l), l->kv.vlen), l);
+	}
+
+	struct kv_vindex *old = h->vindex;
+
+	rcu_assign_pointer(h->vindex, vx);
+	if (old != NULL) kv_arena_free(a, old, vindex_bytes(old->size));
+
+	return TRUE;
+}
+
+/* vindex_add:  records node, just appended to chain h, in h's value index;
+ *              a chain reaching KV_VINDEX_MIN values is given its index here.
+ *              Should the index not be (re)built, the chain goes without and
+ *              is scanned instead, which is slower but still correct        */
+static void vindex_add (struct kv_arena *a, struct kv_head *h,
+                        struct kv_list *node) {
+	struct kv_vindex *vx = h->vindex;
+
+	/* a long chain is indexed from scratch, which also indexes node */
+	if (vindex_resize(h, h->num_vals) != 0) {
+		if (!vindex_build(a, h)) vindex_drop(a, h);
+		return;
+	}
+
+	/* and a short one is not indexed at all */
+	if (vx == NULL) return;
+
+	if (vindex_place(vx, val_hash(kv_val(node), node->kv.vlen), node)) {
+		vx->used++;
+	}
+}
+
+/* vindex_remove:  removes node from chain h's value index (if h has one) */
+static void vindex_remove (struct kv_head *h, struct kv_list *node) {
+	struct kv_vindex *vx = h->vindex;
+	u32               mask;
+	u32               b;
+
+	if (vx == NULL) return;
+
+	mask = vx->size - 1;
+	b    = val_hash(kv_val(node), node->kv.vlen) & mask;
+	for (; vx->slot[b].node != NULL; b = (b+1) & mask) {
+		if (vx->slot[b].node == node) {
+			WRITE_ONCE(vx->slot[b].node, KV_VINDEX_TOMB);
+			return;
+		}
+	}
+}
+
+/* find_val:  returns the element of chain h holding the given value, or NULL;
+ *            an indexed chain is probed, any other chain scanned in order.
+ *            Safe for readers: a value added meanwhile may be missed, but
+ *            never one that was present throughout                        */
+static struct kv_list* find_val (struct kv_head *h, const char *val, int vlen) {
+	struct kv_vindex *vx = kv_deref(h->vindex);
+	struct kv_list   *l;
+
+	if (vx == NULL) {
+		for (l = kv_deref(h->first); l != NULL && !val_is(l, val, vlen);
+		     l = kv_deref(l->next));
+		return l;
+	}
+
+	u32 mask = vx->size - 1;
+	u32 hash = val_hash(val, vlen);
+	u32 b;
+
+	for (b = hash & mask; (l = kv_deref(vx->slot[b].node)) != NULL;
+	     b = (b+1) & mask) {
+		if (l != KV_VINDEX_TOMB && vx->slot[b].hash == hash &&
+		    val_is(l, val, vlen)) {
+			return l;
+		}
+	}
+
+	return NULL;
+}
+
+/* order_add:  links chain h, whose key is new to user, into the user's tree
+ *             of chains sorted by key                                      */
+static void order_add (struct kv_list_h *user, struct kv_head *h) {
+	struct rb_node **link   = &user->ordered.rb_node;
+	struct rb_node  *parent = NULL;
+	const char      *key    = kv_key(h->first);
+	int              klen   = h->first->kv.klen;
+
+	while (*link != NULL) {
+		struct kv_list *m = rb_entry(*link, struct kv_head, order)->first;
+
+		parent = *link;
+		if (kv_key_cmp(key, klen, kv_key(m), m->kv.klen) < 0) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+		}
+	}
+
+	rb_link_node(&h->order, parent, link);
+	rb_insert_color(&h->order, &user->ordered);
+}
+
+/* keys_cap:  the number of slots grow_keys gives user's key table */
+static int keys_cap (const struct kv_list_h *user, int max) {
+	int cap = (user->keys == NULL) ? KV_KEYS_MIN : user->keys->cap * 2;
+
+	return (cap > max) ? max : cap;
+}
+
+/* grow_keys:  doubles the number of slots in user's key table (or makes the
+ *             first allocation), never exceeding max; the amortized cost per
+ *             inserted key is O(1).  The old table is freed once no reader
+ *             can be using it.  Returns FALSE if allocation fails           */
+static int grow_keys (struct kv_list_h *user, int max) {
+	struct kv_keys *old = user->keys;
+	int             cap = keys_cap(user, max);
+
+	struct kv_keys *keys = kzalloc(sizeof(struct kv_keys) + keys_bytes(cap),
+	                               GFP_KERNEL);
+	if (keys == NULL) return FALSE;
+
+	keys->cap    = cap;
+	keys->hashes = (u32 *) (keys->heads + cap);
+
+	if (old != NULL) {
+		memcpy(keys->heads,  old->heads,  user->num_keys*sizeof(struct kv_head *));
+		memcpy(keys->hashes, old->hashes, user->num_keys*sizeof(u32));
+	}
+
+	rcu_assign_pointer(user->keys, keys);
+	if (old != NULL) kfree_rcu(old, rcu);
+
+	return TRUE;
+}
+
 /* init_vault:  initializes the key vault */
-int  init_vault (struct key_vault *v, int size) {
+int  init_vault (struct key_vault *v, int max_keys, int flags) {
 
-   /* allocate memory for the key vault */
+   /* the vault starts with no users; each is added on first insert */
    v->num_users = 0;
-   v->ukey_data = kmalloc(size*sizeof(struct kv_list_h), GFP_KERNEL);
-	memset(v->ukey_data, 0, size*sizeof(struct kv_list_h));
+   v->max_keys  = max_keys;
+   v->flags     = flags;
+
+   /* no quotas unless the caller sets them */
+   v->soft_quota = 0;
+   v->hard_quota = 0;
+   INIT_RADIX_TREE(&v->users, GFP_KERNEL);
+   mutex_init(&v->users_lock);
 
-   /* if error with allocation, return FALSE */
-   if (v->ukey_data == NULL) return FALSE;
+   /* the vault-wide totals are per-CPU, so updating them never contends */
+   if (percpu_counter_init(&v->num_vkeys, 0, GFP_KERNEL)) return FALSE;
+
+   if (percpu_counter_init(&v->num_vpairs, 0, GFP_KERNEL)) {
+      percpu_counter_destroy(&v->num_vkeys);
+      return FALSE;
+   }
+
+   if (percpu_counter_init(&v->num_vbytes, 0, GFP_KERNEL)) {
+      percpu_counter_destroy(&v->num_vpairs);
+      percpu_counter_destroy(&v->num_vkeys);
+      return FALSE;
+   }
 
-   /* otherwise, set the num_users field accordingly */
-   v->num_users = size;
    return TRUE;
 }
 
-/* dump_vault:  prints the contents of the vault to stdout */
+/* find_user:  returns the key data of user uid, or NULL if the user has none;
+ *             when create is TRUE, empty key data is added for a new user.
+ *             Readers may look users up under rcu_read_lock(); users are
+ *             only ever removed by close_vault                           */
+struct kv_list_h* find_user (struct key_vault *v, uid_t uid, int create) {
+	struct kv_list_h *user = radix_tree_lookup(&v->users, uid);
+
+	/* the user is already present, or is not to be added */
+	if (user != NULL || !create) return user;
+
+	/* otherwise, allocate the new user's (empty) key data */
+	user = kmalloc(sizeof(struct kv_list_h), GFP_KERNEL);
+	if (user == NULL) return NULL;
+
+	memset(user, 0, sizeof(struct kv_list_h));
+	user->uid = uid;
+	mutex_init(&user->lock);
+	seqcount_init(&user->seq);
+
+	/* and add it to the map, unless another task added the user first */
+	mutex_lock(&v->users_lock);
+	if (radix_tree_insert(&v->users, uid, user) != 0) {
+		kfree(user);
+		user = radix_tree_lookup(&v->users, uid);
+	} else {
+		v->num_users++;
+	}
+	mutex_unlock(&v->users_lock);
+
+	return user;
+}
+
+/* release_user:  frees all memory held by a user's key data */
+static void release_user (struct kv_list_h *user) {
+
+   /* every chain and its head lives in the user's arena, so dropping the
+      arena's chunks frees them all without visiting each one */
+   kv_arena_release(&user->arena);
+
+   /* free the allcoated memory for this user */
+   kfree (user->keys);
+   kfree (user->index);
+   kfree (user);
+}
+
+/* dump_vault:  prints the contents of the vault to stdout; users are visited
+ *              in increasing uid order, and each user's keys in direction dir */
 void dump_vault (struct key_vault *v, int dir) {
-   struct kv_list_h *udata = v->ukey_data;
 	seq_func_ptr      next  = (dir == FORWARD) ? next_key : prev_key;
-	int               num   = v->num_users;
+	struct kv_list_h *batch[KV_UID_BATCH];
+	unsigned long     from  = 0;
+	int               found;
 	int               u;
-   
-   /* print the keys for each user */
-   for (u = 0; u < num; u++) {
-   	int  uid  = (dir == FORWARD) ? u : num-u-1; /* uid is zero-indexed */
-      int  n    = udata[uid].num_keys;
-      int  i;
 
-      // printf("Key-value pairs for user %d:\n", uid+1);
+	/* fetch the users a batch at a time, in order of uid */
+	while ((found = radix_tree_gang_lookup(&v->users, (void **) batch, from,
+	                                       KV_UID_BATCH)) > 0) {
+
+		/* print the keys for each user */
+		for (u = 0; u < found; u++) {
+			struct kv_list_h *user = batch[u];
+			int               n    = user->num_keys;
 
-		/* this user has no keys to print */
-		if (n == 0) continue;
+			// printf("Key-value pairs for user %u:\n", user->uid);
 
-		/* references the key-value pair to be printed */
-      struct kv_list *l;
+			/* this user has no keys to print */
+			if (n == 0) continue;
 
-		/* point l at the first (or last) key in the user's set */
-		if   (dir == FORWARD) l = udata[uid].data[0];
-		else                  l = get_last_in_list(udata[uid].data[n-1]);
+			/* references the key-value pair to be printed */
+			struct kv_list *l;
 
-		/* print keys in FORWARD (or REVERSE) sequence until they are exhausted */
-		while (l != NULL) {
-         // printf("\t[%s %s]\n", l->kv.key, l->kv.val);
-			l = next(v, uid+1, l);
+			/* point l at the first (or last) key in the user's set */
+			if   (dir == FORWARD) l = user->first_key->first;
+			else                  l = user->last_key->last;
+
+			/* print keys in FORWARD (or REVERSE) sequence until exhausted */
+			while (l != NULL) {
+				// printf("\t[%.*s %.*s]\n", l->kv.klen, kv_key(l),
+				//                          l->kv.vlen, kv_val(l));
+				l = next(v, user->uid, l);
+			}
 		}
-   }
+
+		/* resume the lookup just past the last user of this batch */
+		from = (unsigned long) batch[found-1]->uid + 1;
+	}
 }
 
 /* close_vault:  releases the allocated memory for the vault */
 void close_vault (struct key_vault *v) {
-   /* no data allocated, simply return */
-   if (v->ukey_data == NULL) return;
-
-   /* release allocations for each user */
-   int i;
-   for (i = 0; i < v->num_users; i++) {
-      
-      /* if memory was allocated to this user, release it */
-      if (v->ukey_data[i].data != NULL) {
-
-         /* free memory for each chain of linked-list values */
-         int n = v->ukey_data[i].num_keys;
-         int k;
-         for (k = 0; k < n; k++){
-            free_list(v->ukey_data[i].data[k]);
-         }
-
-         /* free the allcoated memory for this user */
-         kfree (v->ukey_data[i].data);
+   struct kv_list_h *batch[KV_UID_BATCH];
+   int               found;
+   int               i;
+
+   /* let every pending RCU callback (deferred frees) run to completion */
+   rcu_barrier();
+
+   /* release allocations for each user, removing users a batch at a time */
+   while ((found = radix_tree_gang_lookup(&v->users, (void **) batch, 0,
+                                          KV_UID_BATCH)) > 0) {
+      for (i = 0; i < found; i++) {
+         radix_tree_delete(&v->users, batch[i]->uid);
+         release_user(batch[i]);
       }
    }
 
-   /* free the array of user data */
-   kfree (v->ukey_data);
+   v->num_users = 0;
+
+   percpu_counter_destroy(&v->num_vkeys);
+   percpu_counter_destroy(&v->num_vpairs);
+   percpu_counter_destroy(&v->num_vbytes);
 }
 
-/* num_keys:  how many unique keys inserted by this; user uid 1-indexed */
-int num_keys (struct key_vault *v, int uid) {
-	if (uid < 1 || uid > v->num_users) return -1;
-	
-	return v->ukey_data[uid-1].num_keys;
+/* num_keys:  how many unique keys inserted by this user */
+int num_keys (struct key_vault *v, uid_t uid) {
+	struct kv_list_h *user = find_user(v, uid, FALSE);
+
+	return (user == NULL) ? 0 : user->num_keys;
 }
 
 /* rem_keys:  how many additional unique keys may yet be inserted by user */
-/* uid 1-indexed */
-int rem_keys (struct key_vault *v, int uid) {
-	if (uid < 1 || uid > v->num_users) return -1;
-	
-	return MAX_KEY_USER - v->ukey_data[uid-1].num_keys;
+int rem_keys (struct key_vault *v, uid_t uid) {
+	return v->max_keys - num_keys(v, uid);
 }
 
 /* num_pairs(int):  how many total key-value pairs have been inserted by user */
-/* uid 1-indexed */
-int num_pairs (struct key_vault *v, int uid) {
-	if (uid < 1 || uid > v->num_users) return -1;
-	
-	return v->ukey_data[uid-1].total_key_val_pairs;
-}
-
-/* num_vkeys(void):  how many unique keys have been inserted into vault */
-int num_vkeys (struct key_vault *v) {
-	int sum = 0, uid;
-	for (uid = 0; uid < v->num_users; uid++) {
-		sum += num_keys(v, uid+1);
-	}
-	return sum;
+int num_pairs (struct key_vault *v, uid_t uid) {
+	struct kv_list_h *user = find_user(v, uid, FALSE);
+
+	return (user == NULL) ? 0 : user->total_key_val_pairs;
+}
+
+/* num_bytes:  how many bytes of key data are held for this user */
+long num_bytes (struct key_vault *v, uid_t uid) {
+	struct kv_list_h *user = find_user(v, uid, FALSE);
+
+	return (user == NULL) ? 0 : user_bytes(user);
+}
+
+/* num_vkeys(void):  how many unique keys have been inserted into vault; the
+ *                   per-CPU deltas are folded in, so the total is exact */
+s64 num_vkeys (struct key_vault *v) {
+	return percpu_counter_sum_positive(&v->num_vkeys);
 }
 
 /* num_vpairs(void):  how many key-value pairs have been inserted into vault */
-int num_vpairs (struct key_vault *v) {
-	int sum = 0, uid;
-	for (uid = 0; uid < v->num_users; uid++) {
-		sum += num_pairs(v, uid+1);
+s64 num_vpairs (struct key_vault *v) {
+	return percpu_counter_sum_positive(&v->num_vpairs);
+}
+
+/* num_vbytes(void):  how many bytes of key data are held for all users */
+s64 num_vbytes (struct key_vault *v) {
+	return percpu_counter_sum_positive(&v->num_vbytes);
+}
+
+/* insert_growth:  how many bytes inserting a pair of the given lengths would
+ *                 add to user_bytes: the chunks and oversized strings its
+ *                 arena would take, and the growth of any table; h is the
+ *                 key's chain, or NULL for a new key                        */
+static size_t insert_growth (struct key_vault *v, struct kv_list_h *user,
+                             const struct kv_head *h, int klen, int vlen) {
+	struct key_val kv   = { .klen = klen, .vlen = vlen };
+	size_t         size[4];
+	size_t         grow = 0;
+	int            n    = 0;
+
+	/* the arena requests, in the order insert_user_pair makes them */
+	if (h == NULL) size[n++] = sizeof(struct kv_head);
+	size[n++] = node_size(&kv);
+	if (!kv_inline(&kv)) size[n++] = klen + vlen;
+	if (h != NULL && (v->flags & KV_VAULT_SET)) {
+		int vx = vindex_resize(h, h->num_vals + 1);
+		if (vx != 0) size[n++] = vindex_bytes(vx);
+	}
+
+	/* a new key may also double the key table and rehash the index */
+	if (h == NULL) {
+		int cap = (user->keys == NULL) ? 0 : user->keys->cap;
+		int ix  = index_resize(user);
+		int old = (user->index == NULL) ? 0 : user->index->size;
+
+		if (user->num_keys == cap) {
+			grow += keys_bytes(keys_cap(user, v->max_keys)) - keys_bytes(cap);
+		}
+		if (ix > old) grow += (ix - old) * sizeof(struct kv_islot);
 	}
-	return sum;
+
+	return grow + kv_arena_need(&user->arena, size, n);
 }
 
-/* insert_pair: inserts key-value pair for given uid (one-indexed) into vault */
-int  insert_pair (struct key_vault *v, int uid, char *key, char *val) {
+/* insert_user_pair:  inserts a key-value pair into user's key data, for
+ *                     insert_pair; returns 0 or a negative errno */
+static int insert_user_pair (struct key_vault *v, struct kv_list_h *user,
+                             const char *key, int klen,
+                             const char *val, int vlen) {
+
+   /* look up the key's slot in this user's index */
+   struct kv_head  *h    = NULL;
+   u32              hash = key_hash(key, klen);
+   int              i    = index_lookup(user, key, klen, hash, &h);
+   int              new  = (i < 0);
+
+   /* in set mode, a pair already present is not stored a second time */
+   if (!new && (v->flags & KV_VAULT_SET) && find_val(h, val, vlen) != NULL) {
+      return 0;
+   }
+
+   /* no more new keys permitted for this user */
+   if (new && user->num_keys >= v->max_keys) return -ENOSPC;
 
-   /* key-value pairs not kept for this uid, return FALSE */
-   if (uid < 1 || uid > v->num_users) return FALSE;
+   /* refuse a pair that would take the user past the hard quota, counting
+      what user_bytes would be once the arena and tables have grown for it */
+   if (v->hard_quota != 0 &&
+       user_bytes(user) + insert_growth(v, user, new ? NULL : h, klen, vlen) >
+       v->hard_quota) {
+      return -EDQUOT;
+   }
+
+   /* a new key takes the next unused head slot */
+   if (new) {
+      i = user->num_keys;
 
-   /* locate the given user's key data */
-   struct kv_list_h *user = &v->ukey_data[uid-1];
+      /* the key table is full (or, for a first key, not yet allocated) */
+      if ((user->keys == NULL || i == user->keys->cap) &&
+          !grow_keys(user, v->max_keys)) {
+         return -ENOMEM;
+      }
 
-   /* if first key for this user, then we need to allocate memory */
-	/* former test was "user->num_keys == 0"; however, in the context of
-      deletion, we could allocate for the first key, then delete it
-      dropping num_keys to zero, yet we do not need to re-allocate.
-    */
-   if (user->data == NULL) {
-      user->data = kmalloc(MAX_KEY_USER*sizeof(struct kv_list*), GFP_KERNEL);
+      /* make room in the index before the key is committed */
+      if (!index_reserve(user)) return -ENOMEM;
 
-      /* if allocation fails, then return false */
-      if (user->data == NULL) return FALSE;
+      /* and give it an (empty) chain of values, unseen by readers for now */
+      h = kv_arena_alloc(&user->arena, sizeof(struct kv_head));
+      if (h == NULL) return -ENOMEM;
 
-		memset(user->data, 0, MAX_KEY_USER*sizeof(struct kv_list*));
+      memset(h, 0, sizeof(struct kv_head));
+      h->stamp = ++user->stamp;
    }
-   
-   /* scan this user's keys for duplicates */
-   struct kv_list **la = user->data;
-   int i;
-   for (i = 0; i < user->num_keys; i++) {
-      /* duplicate key found, exit loop */
-      if (strncmp(la[i]->kv.key, key, MAX_KEY_SIZE) == 0) break;
+
+   /* key could not be inserted, so a chain allocated above is released */
+   if (!insert_in_list(&user->arena, h, ++user->stamp, key, klen, val, vlen)) {
+      if (new) kv_arena_free(&user->arena, h, sizeof(struct kv_head));
+      return -ENOMEM;
    }
 
-   /* no more new keys permitted for this user, return FALSE */
-   if (i == MAX_KEY_USER) return FALSE;
+   user->total_key_val_pairs++;
+   percpu_counter_inc(&v->num_vpairs);
+
+   /* a set keeps its values indexed, for the duplicate check above */
+   if (v->flags & KV_VAULT_SET) vindex_add(&user->arena, h, h->last);
+
+   /* inserted key was a new (non-duplicate) key */
+   if (new) {
+      struct kv_keys *keys = user->keys;
+
+      /* publish the now complete chain in its slot and in the index */
+      h->prev = user->last_key;
 
-   int rc = insert_in_list(&la[i], key, val);
+      /* readers spin on seq, some under a spinlock, so the writer must
+         not be preempted inside its section */
+      preempt_disable();
+      write_seqcount_begin(&user->seq);
+      keys->hashes[i] = hash;
+      rcu_assign_pointer(keys->heads[i], h);
+      index_add(user, hash, i);
+      WRITE_ONCE(user->num_keys, i + 1);
+      write_seqcount_end(&user->seq);
+      preempt_enable();
 
-   /* key was successfully inserted */
-   if (rc) {
-		user->total_key_val_pairs++;
+      /* and thread it onto the end of the user's list of keys */
+      if (user->last_key != NULL) rcu_assign_pointer(user->last_key->next, h);
+      else                        rcu_assign_pointer(user->first_key, h);
+      user->last_key = h;
 
-      /* inserted key was a new (non-duplicate) key */
-      if (i == user->num_keys) user->num_keys++;
+      if (v->flags & KV_VAULT_ORDERED) order_add(user, h);
 
-   /* or not */
-   } else {
-		;
+      percpu_counter_inc(&v->num_vkeys);
    }
 
-   return rc;
+   return 0;
 }
 
-/* delete_pair: deletes key-value pair for given uid (one-indexed) from vault */
-void delete_pair (struct key_vault *v, int uid, char *key, char *val) {
+/* insert_pair: inserts key-value pair for given uid into vault */
+int  insert_pair (struct key_vault *v, uid_t uid, const char *key, int klen,
+                  const char *val, int vlen) {
 
-	/* find the key to delete */
-	struct kv_list *l = find_key_val(v, uid, key, val);
+   /* keys must be non-empty, and neither string may exceed its limit */
+   if (klen < 1 || klen > MAX_KEY_SIZE || vlen < 0 || vlen > MAX_VAL_SIZE) {
+      return -EINVAL;
+   }
 
-	/* key-value pair is not present */
-	if (l == NULL) return;
+   /* locate the given user's key data, creating it for a new user */
+   struct kv_list_h *user = find_user(v, uid, TRUE);
+   if (user == NULL) return -ENOMEM;
 
-	/* determine if the key is at the head of a list */
+   /* whatever the outcome, carry the change in the user's bytes to the vault */
+   size_t before = user_bytes(user);
+   int    rc     = insert_user_pair(v, user, key, klen, val, vlen);
+
+   percpu_counter_add(&v->num_vbytes, (s64) user_bytes(user) - before);
+
+   /* and let what the insert freed be reused once readers are done with it */
+   kv_arena_flush(&user->arena);
+
+   return rc;
+}
+
+/* delete_pair: deletes key-value pair for given uid from vault */
+void delete_pair (struct key_vault *v, uid_t uid, const char *key, int klen,
+                  const char *val, int vlen) {
+
+	/* find the chain holding the key */
 	int i;
-	int num_keys = v->ukey_data[uid-1].num_keys;
-	for (i = 0; i < num_keys; i++) {
-		if (v->ukey_data[uid-1].data[i] == l) break;
-	}
+	struct kv_list *l = find_key(v, uid, key, klen, &i);
 
-	/* test for head of list with only one element */
-	int only_element_in_list = FALSE;
-	int head_of_list = FALSE;
-	if (i < num_keys) {
-		head_of_list = TRUE;
-		only_element_in_list = (int) (l->next == NULL);
-	}
+	/* then the value within that chain */
+	if (l != NULL) l = find_val(l->head, val, vlen);
 
+	/* key-value pair is not present */
+	if (l == NULL) return;
 
-	/* point the head pointer to the next element (could be NULL) */
-	if (head_of_list) {
-		v->ukey_data[uid-1].data[i] = l->next;
-	}
+	struct kv_list_h *user   = find_user(v, uid, FALSE);
+	struct kv_keys   *keys   = user->keys;
+	struct kv_head  **la     = keys->heads;
+	struct kv_head   *h      = la[i];
+	int               last   = user->num_keys - 1;
+	size_t            before = user_bytes(user);
 
-	/* the key-value pair about to be deleted is the last in its list */
-	if (only_element_in_list) {
-		struct kv_list **la = v->ukey_data[uid-1].data;
+	/* a cursor that read the generation before this must look its pair up
+	   again, so the bump is made visible before the pair is unlinked */
+	WRITE_ONCE(user->gen, user->gen + 1);
+	smp_wmb();
 
-		/* to avoid holes among list pointers, compact the list head pointers */
-		int j;
-		for (j = i; j < num_keys-1; j++) {
-			la[j] = la[j+1];
+	/* the key-value pair about to be deleted is the last in its list */
+	if (h->num_vals == 1) {
+
+		/* unthread its chain from the user's list of keys; a reader standing
+		   on the chain still finds its way on through the chain's own links */
+		if (h->prev != NULL) rcu_assign_pointer(h->prev->next,   h->next);
+		else                 rcu_assign_pointer(user->first_key, h->next);
+		if (h->next != NULL) rcu_assign_pointer(h->next->prev,   h->prev);
+		else                 user->last_key = h->prev;
+
+		if (v->flags & KV_VAULT_ORDERED) rb_erase(&h->order, &user->ordered);
+
+		/* drop the key from the index and, to avoid a hole among the head
+		   pointers, move the last one (and its hash) into the vacated slot;
+		   iteration follows the threaded list, not the slots, so neither key
+		   order nor any cursor is disturbed, and a lookup that races with the
+		   move is retried */
+		preempt_disable();
+		write_seqcount_begin(&user->seq);
+		index_reslot(user, keys->hashes[i], i, KV_INDEX_TOMB);
+		if (i != last) {
+			keys->hashes[i] = keys->hashes[last];
+			rcu_assign_pointer(la[i], la[last]);
+			index_reslot(user, keys->hashes[i], last, i);
 		}
-		v->ukey_data[uid-1].num_keys--;
 
 		/* NULL-terminate what was the head pointer to the last list */
-		v->ukey_data[uid-1].data[num_keys-1] = NULL;
+		RCU_INIT_POINTER(la[last], NULL);
+		WRITE_ONCE(user->num_keys, last);
+		write_seqcount_end(&user->seq);
+		preempt_enable();
+
+		percpu_counter_dec(&v->num_vkeys);
+
+		/* the chain's memory is reused only after a grace period */
+		vindex_drop(&user->arena, h);
+		free_list(&user->arena, l);
+		kv_arena_free(&user->arena, h, sizeof(struct kv_head));
+
+	/* otherwise, just unlink the pair from its chain (and its index) */
+	} else {
+		vindex_remove(h, l);
+		delete_from_list(&user->arena, h, l);
 	}
 
-	delete_from_list(&l);
+	/* reduce the total number for this uid, and for the vault */
+	user->total_key_val_pairs--;
+	percpu_counter_dec(&v->num_vpairs);
+	percpu_counter_add(&v->num_vbytes, (s64) user_bytes(user) - before);
 
-	/* reduce the total number for this uid */
-	v->ukey_data[uid-1].total_key_val_pairs--;
+	kv_arena_flush(&user->arena);
 }
 
-/* retrieve_val:  retrieves value(s) for key for given uid (one-indexed) */
-int  retrieve_val (struct key_vault *v, int uid, char *key, 
-						 char val[MAX_KEY_USER][MAX_VAL_SIZE]) {
+/* retrieve_val:  retrieves value(s) for key for given uid */
+int  retrieve_val (struct key_vault *v, uid_t uid, const char *key, int klen,
+						 struct kv_list *vals[MAX_KEY_USER]) {
    
-	/* required parameter for find_key, but not used in this function */
+	/* used below to reach the key's chain head */
 	int key_num;
 
 	/* get pointer to key-value pair in vault */
-	struct kv_list *l = find_key(v, uid, key, &key_num);
+	struct kv_list *l = find_key(v, uid, key, klen, &key_num);
 
 	/* if l is NULL, then the key is not present */
 	if (l == NULL) return 0;
 
-   /* otherwise, key was found, retrive cnt associated value(s) */
+   /* otherwise, key was found, retrive up to MAX_KEY_USER associated values */
    int cnt = 0;
-   while (l != NULL) {
-      strncpy(val[cnt], l->kv.val, MAX_VAL_SIZE);
+   while (l != NULL && cnt < MAX_KEY_USER) {
+      vals[cnt] = l;
       cnt++;
-      l = l->next;
+      l = kv_deref(l->next);
    }
 
-   return cnt;
+   /* the chain head knows how many values there are in all */
+   return READ_ONCE(vals[0]->head->num_vals);
 }
 
 /* find_key:  finds the specified key in the vault and returns a pointer to
  *            it, or returns NULL if the key is not present; also sets
- *            key_num to the sequential location of the key in the vault 
- *            Note, uid is one-indexed.
+ *            key_num to the slot of the key's chain in the user's keys
  */
-struct kv_list* find_key (struct key_vault *v, int uid, char *key, 
-								  int *key_num) {
+struct kv_list* find_key (struct key_vault *v, uid_t uid, const char *key,
+								  int klen, int *key_num) {
 
 	/* assume key for which we are searching is not the last in the user's set */
 	*key_num = 0;
 
-   /* key-value pairs not kept for this uid, return NULL */
-   if (uid < 1 || uid > v->num_users) return NULL;
-
-   /* locate the given user's key data */
-   struct kv_list_h *user = &v->ukey_data[uid-1];
+   /* locate the given user's key data; a user without any has no keys */
+   struct kv_list_h *user = find_user(v, uid, FALSE);
+   if (user == NULL) return NULL;
    
-   /* scan this user's keys for match */
-   struct kv_list **la = user->data;
-   int i;
-   for (i = 0; i < user->num_keys; i++) {
-      /* key found, exit loop */
-      if (strncmp(la[i]->kv.key, key, MAX_KEY_SIZE) == 0) break;
-   }
+   /* look the key up in this user's index, again if a key moved meanwhile */
+   struct kv_head *h    = NULL;
+   u32             hash = key_hash(key, klen);
+   unsigned        seq;
+   int             i;
+
+   do {
+      seq = read_seqcount_begin(&user->seq);
+      i   = index_lookup(user, key, klen, hash, &h);
+   } while (read_seqcount_retry(&user->seq, seq));
 
    /* if key not found, return NULL */
-   if (i == user->num_keys) return NULL;
+   if (i < 0) return NULL;
 
 	/* otherwise, set key_num and return l as the pointer to the kv_list */
 	*key_num = i;
-	return la[i];
+	return kv_deref(h->first);
 }
 
 /* find_key_val:  finds the specified key-value pair and returns a pointer to
- *                it, or returns NULL if the pair is not present. uid 1-index */
-struct kv_list*  find_key_val (struct key_vault *v, int uid, char *key, 
-									    char  *val) {
+ *                it, or returns NULL if the pair is not present. */
+struct kv_list*  find_key_val (struct key_vault *v, uid_t uid, const char *key,
+									    int klen, const char *val, int vlen) {
 
 	int key_num;  /* unused */
 
 	/* find the appropriate list of keys (if present) */
-	struct kv_list *l = find_key(v, uid, key, &key_num);
+	struct kv_list *l = find_key(v, uid, key, klen, &key_num);
 
-	/* if there is such a key list, now search for the selected value */
-	if (l != NULL) {
-
-		/* loop while we have values to check and have not yet found the value */ 
-      while (l != NULL && (strncmp(l->kv.val, val, MAX_VAL_SIZE) != 0)) {
-			l = l->next;
-		}
-	}
+	/* if there is such a key list, now search it for the selected value */
+	if (l != NULL) l = find_val(l->head, val, vlen);
 
 	/* return the outcome:  either NULL (not present) or pointer to the pair */
 	return l;
 }
 
+/* first_key:  returns a pointer to the first key in the current user's set,
+ *             or NULL if the user has no keys
+ */
+struct kv_list* first_key (struct key_vault *v, uid_t uid) {
+
+	/* a user without key data has no keys */
+	struct kv_list_h *user = find_user(v, uid, FALSE);
+	if (user == NULL) return NULL;
+
+	/* otherwise, return the first key of the first chain (if there is one) */
+	struct kv_head *h = kv_deref(user->first_key);
+	return (h == NULL) ? NULL : kv_deref(h->first);
+}
+
 /* next_key:  returns a pointer to the next key in the current user's set,
- *            or NULL if there is no next key.  uid is one-indexed.
+ *            or NULL if there is no next key.  Every element knows its chain
+ *            and every chain its successor, so no lookup is needed (uid is
+ *            only kept for the seq_func_ptr signature).
  */
-struct kv_list* next_key (struct key_vault *v, int uid, struct kv_list *l) {
+struct kv_list* next_key (struct key_vault *v, uid_t uid, struct kv_list *l) {
 
 	/* return NULL, if l is NULL*/
 	if (l == NULL) return NULL;
 
 	/* return the next key in the current list, if present */
-	if (l->next != NULL) return l->next;
-
-	/* otherwise, find the first (perhaps ony) key of this list */
-	int key_num;
-	l = find_key(v, uid, l->kv.key, &key_num);
+	struct kv_list *n = kv_deref(l->next);
+	if (n != NULL) return n;
 
-	/* if this key is the last in the array of keys for this user, return NULL */
-	if (uid < 1 || uid > v->num_users || key_num == v->ukey_data[uid-1].num_keys-1) return NULL;
-
-	/* otherwise, return the next key in the array */
-	return v->ukey_data[uid-1].data[key_num+1];
+	/* otherwise, return the first key of the next chain (if there is one) */
+	struct kv_head *h = kv_deref(l->head->next);
+	return (h == NULL) ? NULL : kv_deref(h->first);
 }
 
 /* prev_key:  returns a pointer to the prev key in the current user's set,
- *            or NULL if there is no prev key.  uid is one-indexed.
+ *            or NULL if there is no prev key.  Like next_key, it runs in
+ *            constant time.
  */
-struct kv_list* prev_key (struct key_vault *v, int uid, struct kv_list *l) {
+struct kv_list* prev_key (struct key_vault *v, uid_t uid, struct kv_list *l) {
+
+	/* return NULL, if l is NULL*/
+	if (l == NULL) return NULL;
 
 	/* return the prev key in the current list, if present */
-	if (l->prev != NULL) return l->prev;
+	struct kv_list *p = kv_deref(l->prev);
+	if (p != NULL) return p;
 
-	/* if this key is first overall key for this user, return NULL */
-	if (uid < 1 || uid > v->num_users || l==v->ukey_data[uid-1].data[0]) return NULL;
+	/* otherwise, return the last key of the prev chain (if there is one) */
+	struct kv_head *h = kv_deref(l->head->prev);
+	return (h == NULL) ? NULL : kv_deref(h->last);
+}
 
-	/* otherwise, find first (perhaps ony) key of list */
-	int num_key;
-	l = find_key(v, uid, l->kv.key, &num_key);
+/* resume_pair:  returns uid's pair key val, stamped stamp under the key
+ *               stamped hstamp, if it is still there.  If it was deleted, the
+ *               pair next_key would have reached after it is returned: its
+ *               key's first value stamped later, or failing that the first
+ *               value of the next key still present, found by its stamp in
+ *               the list of keys when the pair's own key is gone too.  So a
+ *               walk interrupted by deletes neither repeats nor skips a pair.
+ */
+struct kv_list* resume_pair (struct key_vault *v, uid_t uid, const char *key,
+                             int klen, const char *val, int vlen,
+                             u64 hstamp, u64 stamp) {
+	struct kv_list_h *user = find_user(v, uid, FALSE);
+	struct kv_head   *h;
+	struct kv_list   *l;
+	int               i;
+
+	if (user == NULL) return NULL;
+
+	/* the pair itself, when it survives; an equal value added later (in a
+	   multiset) has another stamp and is not taken for it */
+	l = find_key_val(v, uid, key, klen, val, vlen);
+	if (l != NULL && l->stamp == stamp) return l;
+
+	/* else its key's values are stamped in chain order, so the successor is
+	   the first one stamped later */
+	l = find_key(v, uid, key, klen, &i);
+	h = (l == NULL) ? NULL : l->head;
+
+	if (h != NULL && h->stamp == hstamp) {
+		for (; l != NULL; l = kv_deref(l->next)) {
+			if (l->stamp >= stamp) return l;
+		}
+		h = kv_deref(h->next);
+	} else {
+		/* the key went too (it may be back, as a new chain): the keys are
+		   stamped in list order, so resume at the first added after it */
+		for (h = kv_deref(user->first_key); h != NULL && h->stamp < hstamp;
+		     h = kv_deref(h->next));
+	}
 
-	/* otherwise, return the last key in the prev list */
-	l = get_last_in_list(v->ukey_data[uid-1].data[num_key-1]);
+	/* passing over any chain a delete is emptying */
+	for (; h != NULL; h = kv_deref(h->next)) {
+		l = kv_deref(h->first);
+		if (l != NULL) return l;
+	}
 
-	return l;
+	return NULL;
+}
+
+/* kv_key_cmp:  compares two keys bytewise, a shorter key ordering before any
+ *              longer key that it prefixes */
+int kv_key_cmp (const char *a, int alen, const char *b, int blen) {
+	int rc = memcmp(a, b, (alen < blen) ? alen : blen);
+
+	return (rc != 0) ? rc : alen - blen;
+}
+
+/* ordered_seek:  returns the chain holding uid's first key not less than key,
+ *                or NULL if there is none (or the vault keeps no order) */
+struct kv_head* ordered_seek (struct key_vault *v, uid_t uid, const char *key,
+                              int klen) {
+
+	/* only an ordered vault keeps its users' keys in a tree */
+	if (!(v->flags & KV_VAULT_ORDERED)) return NULL;
+
+	struct kv_list_h *user = find_user(v, uid, FALSE);
+	if (user == NULL) return NULL;
+
+	/* descend, remembering the least key found to be no less than key */
+	struct kv_head *best = NULL;
+	struct rb_node *n    = user->ordered.rb_node;
+
+	while (n != NULL) {
+		struct kv_head *h = rb_entry(n, struct kv_head, order);
+
+		if (kv_key_cmp(kv_key(h->first), h->first->kv.klen, key, klen) >= 0) {
+			best = h;
+			n    = n->rb_left;
+		} else {
+			n    = n->rb_right;
+		}
+	}
+
+	return best;
+}
+
+/* ordered_next:  returns the chain following h in key order, or NULL */
+struct kv_head* ordered_next (struct kv_head *h) {
+	struct rb_node *n = rb_next(&h->order);
+
+	return (n == NULL) ? NULL : rb_entry(n, struct kv_head, order);
 }
 
 /* get_last_in_list:  walks given list to last element and returns its ref */
@@ -363,8 +1056,8 @@ struct kv_list*   get_last_in_list (struct kv_list *l) {
 	return l; 
 }
 
-/* free_list:  releases any allocated memory in tail of incoming list */
-void free_list(struct kv_list *l) {
+/* free_list:  returns the incoming list and its tail to arena a */
+void free_list(struct kv_arena *a, struct kv_list *l) {
 
 	/* while there are list elements to release */
 	while (l != NULL) {
@@ -373,76 +1066,78 @@ void free_list(struct kv_list *l) {
 	   struct kv_list *tail = l->next;
 
 		/* release the current list element */
-		kfree (l);
+		free_node(a, l);
 
 		/* reset the head of the list */
 		l = tail;
 	}
 }
 
-/* insert_in_list:  inserts the key-value pair into list l */
-int  insert_in_list (struct kv_list **lp, char *key, char *val) {
-
-	struct kv_list *l;
-
-	/* no keys allocated to this list */
-	if (*lp == NULL) {
-
-		/* so allocate one */
-      *lp = kmalloc(sizeof(struct kv_list), GFP_KERNEL);
-		memset(*lp, 0, sizeof(struct kv_list));
-
-      /* if kmalloc failed, return FALSE */
-      if (*lp == NULL) return FALSE;
-
-		l = *lp;
-
-	/* this this already has keys */
-	} else {
-
-		/* walk the list to the last element */
-		l = *lp;
-		while (l->next != NULL) l = l->next;
+/* insert_in_list:  appends the key-value pair to the chain headed by h,
+ *                  allocating the new list element, stamped stamp, from
+ *                  arena a */
+int  insert_in_list (struct kv_arena *a, struct kv_head *h, u64 stamp,
+                     const char *key, int klen, const char *val, int vlen) {
+	struct key_val kv = { .klen = klen, .vlen = vlen };
+
+	/* allocate the new list element */
+	struct kv_list *l = kv_arena_alloc(a, node_size(&kv));
+
+	/* if the allocation failed, return FALSE */
+	if (l == NULL) return FALSE;
+
+	/* a pair too long to be kept inline gets a buffer of its own */
+	char *bytes = l->data;
+	if (!kv_inline(&kv)) {
+		bytes = kv_arena_alloc(a, klen + vlen);
+		if (bytes == NULL) {
+			kv_arena_free(a, l, node_size(&kv));
+			return FALSE;
+		}
+		*(char **) l->data = bytes;
+	}
 
-      /* add the new key-value pair */
-      l->next = kmalloc(sizeof(struct kv_list), GFP_KERNEL);
+   /* copy the key-value pair into the referenced list element */
+	l->kv = kv;
+   memcpy(bytes,        key, klen);
+   memcpy(bytes + klen, val, vlen);
 
-      /* if kmalloc failed, return FALSE */
-      if (l->next == NULL) return FALSE;
+	/* link it in after the chain's current last element (if any); only then
+	   is the fully initialized element visible to readers */
+	l->prev  = h->last;
+	l->next  = NULL;
+	l->head  = h;
+	l->stamp = stamp;
 
-      /* set new elem's prev ptr, NULL-term next ptr, and adv l to new elem */
-		l->next->prev = l;
-		l->next->next = NULL;
-      l = l->next;
-   }
+	if (h->last != NULL) rcu_assign_pointer(h->last->next, l);
+	else                 rcu_assign_pointer(h->first,      l);
 
-   /* copy the key-value pair into the referenced list element */
-   strncpy(l->kv.key, key, MAX_KEY_SIZE);
-   strncpy(l->kv.val, val, MAX_VAL_SIZE);
+	rcu_assign_pointer(h->last, l);
+	h->num_vals++;
 
    return TRUE;
 }
 
-/* delete_from_list: deletes the referenced key-value pair from vault */
-void delete_from_list (struct kv_list **la) {
-	struct kv_list *l = *la;
+/* delete_from_list: unlinks the referenced pair from chain h and returns it
+ *                   to arena a */
+void delete_from_list (struct kv_arena *a, struct kv_head *h,
+                       struct kv_list *l) {
 
 	if (l == NULL) return;
 
 	struct kv_list *p = l->prev;
 	struct kv_list *n = l->next;
 
-	/* cause previous element in list to reference what appears after l */
-	if (p != NULL) {
-		p->next = n;
-	}
+	/* cause previous element in list to reference what appears after l; l
+	   keeps its own links, so a reader standing on it can move on */
+	if (p != NULL) rcu_assign_pointer(p->next,  n);
+	else           rcu_assign_pointer(h->first, n);
 
 	/* cause next element in list to reference what appears before l */
-	if (n != NULL) {
-		n->prev = p;
-	}
+	if (n != NULL) rcu_assign_pointer(n->prev,  p);
+	else           rcu_assign_pointer(h->last,  p);
 
-	kfree(*la);
-	*la = NULL;
-}
+	h->num_vals--;
 
+	free_node(a, l);
+}
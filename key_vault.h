@@ -4,41 +4,187 @@
  * Purpose: Supports HW4 for CS3320
  * Version: 3 */
 
-#define MAX_KEY_SIZE 20
-#define MAX_VAL_SIZE 20
+#include <linux/types.h>
+#include <linux/radix-tree.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
+#include <linux/percpu_counter.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include "kv_arena.h"
+
+#define MAX_KEY_SIZE 256     /* longest key, in bytes   */
+#define MAX_VAL_SIZE 1024    /* longest value, in bytes */
 #define MAX_KEY_USER 20
 
+/* initial number of head pointers allocated for a user's first key; the
+ * table then doubles as needed, up to the vault's max_keys              */
+#define KV_KEYS_MIN  16
+
+/* pairs whose key and value together fit in this many bytes are stored in
+ * the list node itself; longer pairs keep their bytes in a separate buffer */
+#define KV_INLINE_MAX 32
+
+/* longest "key val" line the text interface accepts, NUL included          */
+#define KV_PAIR_MAX (MAX_KEY_SIZE + 1 + MAX_VAL_SIZE + 1)
+
 #define FORWARD       0
 #define REVERSE       1
 
 #define FALSE         0
 #define TRUE          1
 
-/* structure to hold the key-value pairs                           */
+/* options a vault is created with (see init_vault) */
+#define KV_VAULT_SET      0x1   /* a key holds each value at most once     */
+#define KV_VAULT_ORDERED  0x2   /* each user's keys are also kept sorted   */
+
+/* users fetched per radix tree lookup when walking every user in a vault */
+#define KV_UID_BATCH  16
+
+/* initial number of buckets in a user's key index (must be a power of 2) */
+#define KV_INDEX_MIN  8
+
+/* a user with no more keys than this has no index: the key hashes, which
+ * are packed in one cache line, are scanned instead                        */
+#define KV_SCAN_KEYS  16
+
+/* marks an index bucket that never held a key, or whose key was removed */
+#define KV_INDEX_EMPTY -1
+#define KV_INDEX_TOMB  -2
+
+/* in set mode, a chain of this many values is given an index of its values;
+ * shorter chains are cheaper to scan than to hash                          */
+#define KV_VINDEX_MIN  8
+
+/* marks a value index bucket whose value was removed (empty ones are NULL) */
+#define KV_VINDEX_TOMB ((struct kv_list *) 1)
+
+/* structure to hold the lengths of a key-value pair; the bytes themselves
+ * (which are not NUL-terminated) are reached through kv_key and kv_val     */
 struct key_val {
-	char key[MAX_KEY_SIZE];
-	char val[MAX_VAL_SIZE];
+	u16 klen;
+	u16 vlen;
 };
 
-/* allows the key-value pairs to be grouped into a linked list     */
+/* allows the key-value pairs to be grouped into a linked list; data holds
+ * the key bytes followed by the value bytes when they fit KV_INLINE_MAX, or
+ * otherwise a pointer to a buffer laid out the same way                   */
 struct kv_list {
 	struct key_val  kv;
 	struct kv_list *next;
 	struct kv_list *prev;
+	struct kv_head *head;    /* chain this element belongs to */
+	u64             stamp;   /* its user's stamp when it was added */
+	char            data[] __aligned(sizeof(char *));
+};
+
+/* kv_inline:  whether the pair's bytes are stored in the node itself       */
+static inline int kv_inline (const struct key_val *kv) {
+	return kv->klen + kv->vlen <= KV_INLINE_MAX;
+}
+
+/* kv_key:  the key bytes of list element l (kv.klen of them)               */
+static inline const char *kv_key (const struct kv_list *l) {
+	return kv_inline(&l->kv) ? l->data : *(char * const *) l->data;
+}
+
+/* kv_val:  the value bytes of list element l (kv.vlen of them)             */
+static inline const char *kv_val (const struct kv_list *l) {
+	return kv_key(l) + l->kv.klen;
+}
+
+/* one bucket of the open-addressed index from value hash to list element */
+struct kv_vslot {
+	u32             hash;
+	struct kv_list *node;
+};
+
+/* a chain's value index; it is allocated from the user's arena and replaced
+ * whole when it is rebuilt                                                 */
+struct kv_vindex {
+	int             size;         /* number of buckets, a power of 2        */
+	int             used;         /* buckets that are live or tombs         */
+	struct kv_vslot slot[];
+};
+
+/* heads the chain of values stored under one key; the heads of a user
+ * are themselves threaded into a list in key insertion order      */
+struct kv_head {
+	struct kv_list  *first;
+	struct kv_list  *last;
+	int              num_vals;
+	struct kv_head  *next;        /* next key inserted by the same user     */
+	struct kv_head  *prev;        /* previous key inserted by the same user */
+	struct kv_vindex *vindex;     /* set mode only: value -> element, or
+	                                 NULL while the chain is short          */
+	struct rb_node   order;       /* ordered vaults only: by key            */
+	u64              stamp;       /* its user's stamp when it was added     */
+};
+
+/* one bucket of the open-addressed index from key hash to head slot */
+struct kv_islot {
+	u32 hash;
+	int slot;
+};
+
+/* a user's key index; replaced whole, and freed after a grace period, when
+ * it is rehashed                                                           */
+struct kv_index {
+	struct rcu_head rcu;
+	int             size;         /* number of buckets, a power of 2   */
+	int             used;         /* buckets that are live or tombs    */
+	struct kv_islot slot[];
+};
+
+/* a user's table of key chains, packed in no particular order, with the
+ * key_hash of each chain alongside; replaced whole when it grows          */
+struct kv_keys {
+	struct rcu_head  rcu;
+	int              cap;         /* entries in both arrays            */
+	u32             *hashes;      /* follows heads[] in the allocation */
+	struct kv_head  *heads[];
 };
 
-/* hold information about a list, including a pointer to the head */
+/* hold information about a list, including a pointer to the head.  Updates
+ * are serialized by the caller holding lock; lookups and walks (find_key, find_key_val,
+ * retrieve_val, next_key, prev_key) may run alongside them under
+ * rcu_read_lock(), retrying on seq whenever a key moved under them        */
 struct kv_list_h {
+	uid_t            uid;         /* the user owning this key data     */
+	struct mutex     lock;        /* held by whoever updates the pairs */
 	int              total_key_val_pairs;
 	int              num_keys;
-	struct kv_list **data;
-	struct kv_list  *fp;
+	struct kv_keys  *keys;        /* key chains, by slot               */
+	struct kv_head  *first_key;   /* key chains in insertion order     */
+	struct kv_head  *last_key;
+	unsigned long    gen;         /* bumped by every delete, so cursors
+	                                 can tell a pair may be gone       */
+	struct kv_index *index;       /* maps a key to its slot in keys,
+	                                 once there are over KV_SCAN_KEYS  */
+	seqcount_t       seq;         /* bumped around changes to slots    */
+	struct rb_root   ordered;     /* ordered vaults: chains by key     */
+	struct kv_arena  arena;       /* backs this user's nodes and heads */
+	u64              stamp;       /* bumped for every element and head
+	                                 added, so each has a stamp higher
+	                                 than any added before it          */
 };
 
-/* the key_vault is essentially an array of kv_list head pointers */
+/* the key_vault is essentially a sparse map from uid to each user's key
+ * data; a user's kv_list_h is created the first time the user stores a key.
+ * Each user's data has its own lock, so users never wait on one another;
+ * users_lock guards only the map itself, when a user is added            */
 struct key_vault {
-	int               num_users;
-	struct kv_list_h *ukey_data;
+	int                    num_users;  /* users present in the map   */
+	int                    max_keys;   /* most keys any one user may hold */
+	int                    flags;      /* KV_VAULT_* options             */
+	struct radix_tree_root users;      /* uid -> struct kv_list_h    */
+	struct mutex           users_lock; /* held while adding a user   */
+	struct percpu_counter  num_vkeys;  /* unique keys, all users     */
+	struct percpu_counter  num_vpairs; /* key-value pairs, all users */
+	struct percpu_counter  num_vbytes; /* bytes held, all users      */
+	size_t                 soft_quota; /* bytes per user, 0 if none  */
+	size_t                 hard_quota; /* bytes per user, 0 if none  */
 };
 
 /* we cannot use a global handle for the key vault in this code, because this
@@ -48,14 +194,16 @@ struct key_vault {
 // extern struct key_vault v;
 
 /* a typedefed function pointer for walking the data structure sequentially   */
-typedef struct kv_list*(*seq_func_ptr)(struct key_vault*, int, struct kv_list*);
+typedef struct kv_list*(*seq_func_ptr)(struct key_vault*, uid_t, struct kv_list*);
 
 /*
  * Function prototypes follow
  */
 
-/* init_vault:  initializes the key vault                                     */
-int init_vault (struct key_vault *v, int size);
+/* init_vault:  initializes an empty key vault, in which each user may
+ *              insert up to max_keys unique keys; flags is a combination of
+ *              KV_VAULT_* options.  Returns FALSE on failure                 */
+int init_vault (struct key_vault *v, int max_keys, int flags);
 
 /* dump_vault:  prints the contents of the vault to stdout for debugging      */
 void dump_vault (struct key_vault *v, int dir);
@@ -63,60 +211,106 @@ void dump_vault (struct key_vault *v, int dir);
 /* close_vault:  releases the allocated memory for the vault                  */
 void close_vault (struct key_vault *v);
 
+/* find_user:  returns the key data of user uid, or NULL if the user has none;
+ *             when create is TRUE, empty key data is added for a new user
+ *             (NULL is then returned only if allocation fails)               */
+struct kv_list_h* find_user (struct key_vault *v, uid_t uid, int create);
+
 /* num_keys:  how many unique keys have been inserted by this user            */
-int num_keys (struct key_vault *v, int uid);
+int num_keys (struct key_vault *v, uid_t uid);
 
 /* rem_keys:  how many additional unique keys may yet be inserted by user     */
-int rem_keys (struct key_vault *v, int uid);
+int rem_keys (struct key_vault *v, uid_t uid);
 
 /* num_pairs(int):  how many total key-value pairs have been inserted by user */
-int num_pairs (struct key_vault *v, int uid);
+int num_pairs (struct key_vault *v, uid_t uid);
 
 /* num_vkeys:  how many unique keys have been inserted into the vault         */
-int num_vkeys (struct key_vault *v);
+s64 num_vkeys (struct key_vault *v);
 
 /* num_vpairs(void):  how many key-value pairs have been inserted into vault  */
-int num_vpairs (struct key_vault *v);
+s64 num_vpairs (struct key_vault *v);
+
+/* num_bytes:  how many bytes of kernel memory this user's key data holds     */
+long num_bytes (struct key_vault *v, uid_t uid);
 
-/* insert_pair: inserts key-value pair for given uid (one-indexed) into vault */
-int insert_pair (struct key_vault *v, int uid, char *key, char *val);
+/* num_vbytes:  how many bytes of kernel memory all users' key data holds     */
+s64 num_vbytes (struct key_vault *v);
 
-/* delete_pair: deletes key-value pair for given uid (one-indexed) from vault */
-void delete_pair (struct key_vault *v, int uid, char *key, char *val);
+/* insert_pair: inserts key-value pair for given uid into vault;
+ *              klen and vlen give the lengths of key and val in bytes; in
+ *              set mode, inserting a pair already present changes nothing.
+ *              Returns 0, or -EINVAL (bad length), -ENOSPC (too many keys),
+ *              -EDQUOT (over the hard quota) or -ENOMEM                     */
+int insert_pair (struct key_vault *v, uid_t uid, const char *key, int klen,
+                 const char *val, int vlen);
 
-/* retrieve_val:  retrieves val(s) for key for uid (one-indexed) for debugging*/
- int retrieve_val (struct key_vault *v, int uid, char *key, 
-						char  val[MAX_KEY_USER][MAX_VAL_SIZE]);
+/* delete_pair: deletes key-value pair for given uid from vault */
+void delete_pair (struct key_vault *v, uid_t uid, const char *key, int klen,
+                  const char *val, int vlen);
+
+/* retrieve_val:  retrieves val(s) for key for uid for debugging;
+ *                returns how many values the key holds, of which at most
+ *                MAX_KEY_USER are referenced from vals                       */
+ int retrieve_val (struct key_vault *v, uid_t uid, const char *key, int klen,
+						struct kv_list *vals[MAX_KEY_USER]);
 
 /* find_key:  finds the specified key in the vault and returns a pointer to
  *            it, or returns NULL if the key is not present; also sets
- *            key_num to the sequential location of the key in the vault 
- *            Note, uid is one-indexed.                                       */
-struct kv_list*  find_key  (struct key_vault *v, int uid, char *key, 
-									 int *key_num);
+ *            key_num to the slot of the key's chain in the user's data[]   */
+struct kv_list*  find_key  (struct key_vault *v, uid_t uid, const char *key,
+									 int klen, int *key_num);
 
 /* find_key_val:  finds the specified key-value pair and returns a pointer to
  *                it, or returns NULL if the pair is not present.             */
-struct kv_list*  find_key_val (struct key_vault *v, int uid, char *key, 
-									    char  *val);
+struct kv_list*  find_key_val (struct key_vault *v, uid_t uid, const char *key,
+									    int klen, const char *val, int vlen);
+
+/* first_key:  returns a pointer to the first key in the current user's set,
+ *             or NULL if the user has none; safe under rcu_read_lock()     */
+struct kv_list*  first_key (struct key_vault *v, uid_t uid);
 
 /* next_key:  returns a pointer to the next key in the current user's set,
- *            or NULL if there is no next key.  uid is one-indexed.           */
-struct kv_list*  next_key  (struct key_vault *v, int uid, struct kv_list *l);
+ *            or NULL if there is no next key; runs in constant time         */
+struct kv_list*  next_key  (struct key_vault *v, uid_t uid, struct kv_list *l);
 
 /* prev_key:  returns a pointer to the prev key in the current user's set,
- *            or NULL if there is no prev key.  uid is one-indexed.           */
-struct kv_list*  prev_key  (struct key_vault *v, int uid, struct kv_list *l);
+ *            or NULL if there is no prev key; runs in constant time         */
+struct kv_list*  prev_key  (struct key_vault *v, uid_t uid, struct kv_list *l);
+
+/* resume_pair:  returns uid's pair key val with the given stamps if it is
+ *               still there, or else the pair next_key would have reached
+ *               after it; NULL at the end.  Safe for readers               */
+struct kv_list*  resume_pair (struct key_vault *v, uid_t uid, const char *key,
+                              int klen, const char *val, int vlen,
+                              u64 hstamp, u64 stamp);
+
+/* kv_key_cmp:  compares two keys bytewise, returning <0, 0 or >0; a key
+ *              orders before any longer key of which it is a prefix         */
+int kv_key_cmp (const char *a, int alen, const char *b, int blen);
+
+/* ordered_seek:  returns the chain of uid's first key not less than key, or
+ *                NULL if there is none or the vault is not KV_VAULT_ORDERED */
+struct kv_head*  ordered_seek (struct key_vault *v, uid_t uid, const char *key,
+                               int klen);
+
+/* ordered_next:  returns the chain whose key follows h's, or NULL          */
+struct kv_head*  ordered_next (struct kv_head *h);
 
 /* get_last_in_list:  walks given list to last element and returns its ref    */
 struct kv_list*  get_last_in_list (struct kv_list *l);
 
-/* free_list:  releases any allocated memory in tail of incoming list         */
-void free_list (struct kv_list *l);
+/* free_list:  returns the incoming list and its tail to arena a             */
+void free_list (struct kv_arena *a, struct kv_list *l);
 
-/* insert_in_list:  inserts the key-value pair into list l                    */
-int insert_in_list (struct kv_list **l, char *key, char *val);
+/* insert_in_list:  appends the key-value pair to the chain headed by h,
+ *                  allocating the new list element, stamped stamp, from
+ *                  arena a                                                 */
+int insert_in_list (struct kv_arena *a, struct kv_head *h, u64 stamp,
+                    const char *key, int klen, const char *val, int vlen);
 
-/* delete_from_list: deletes the referenced key-value pair from vault */
-void delete_from_list (struct kv_list **l);
+/* delete_from_list: unlinks the referenced pair from chain h and returns it
+ *                   to arena a                                               */
+void delete_from_list (struct kv_arena *a, struct kv_head *h,
+                       struct kv_list *l);
 
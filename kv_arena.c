@@ -0,0 +1,260 @@
+/* kv_arena.c -- chunked allocator behind each user's key data
+ *
+ * Allocations are rounded up to KV_ARENA_ALIGN and sorted into size classes.
+ * A request is served from its class's free list when possible and is
+ * otherwise bumped off the newest chunk.  Freed objects are never returned
+ * to the slab individually; they wait on their free list for reuse until
+ * kv_arena_release drops the arena's chunks all at once.  Requests larger
+ * than KV_ARENA_MAX are kmalloc'd and kept on a doubly linked list instead.
+ *
+ * Since the slab sees only chunks, each arena counts the objects it hands
+ * out and takes back, and the chunks it holds, for the node churn that
+ * /proc/slabinfo no longer shows.
+ *
+ * A free is first recorded in the arena's current limbo batch.  At the end of
+ * an update kv_arena_flush hands the batch to call_rcu, whose callback moves
+ * it onto the lock-free ripe list; the next allocation then recycles it.
+ */
+
+#include <linux/slab.h>       /* for kmem_cache_* */
+#include <linux/kernel.h>     /* for ALIGN */
+#include <linux/string.h>     /* for memset */
+#include "kv_arena.h"
+
+/* usable bytes in a chunk once its header is accounted for */
+#define CHUNK_PAYLOAD (KV_ARENA_CHUNK - sizeof(struct kv_chunk))
+
+/* the slab cache from which every arena draws its chunks; note that SLUB may
+ * merge it with a compatible cache unless the kernel is booted slab_nomerge */
+static struct kmem_cache *kv_chunk_cache = NULL;
+
+/* kv_arena_init_cache:  creates the slab cache that supplies arena chunks */
+int kv_arena_init_cache (void) {
+	kv_chunk_cache = kmem_cache_create("kv_mod_chunk", KV_ARENA_CHUNK,
+	                                   0, 0, NULL);
+
+	return kv_chunk_cache != NULL;
+}
+
+/* kv_arena_close_cache:  destroys the chunk cache after every arena is gone */
+void kv_arena_close_cache (void) {
+	if (kv_chunk_cache == NULL) return;
+
+	kmem_cache_destroy(kv_chunk_cache);
+	kv_chunk_cache = NULL;
+}
+
+/* recycle:  makes object p, freed with size, available again; an oversized
+ *           object is identified by its kv_big header and kfree'd          */
+static void recycle (struct kv_arena *a, void *p, size_t size) {
+	if (size > KV_ARENA_MAX) {
+		a->held -= sizeof(struct kv_big) + size;
+		kfree(p);
+		return;
+	}
+
+	int cls = ALIGN(size, KV_ARENA_ALIGN) / KV_ARENA_ALIGN - 1;
+
+	/* thread the object onto its size class's free list */
+	*(void **) p = a->free[cls];
+	a->free[cls] = p;
+}
+
+/* recycle_limbo:  recycles every object of batch l, then the batch itself */
+static void recycle_limbo (struct kv_arena *a, struct kv_limbo *l) {
+	int i;
+
+	for (i = 0; i < l->n; i++) recycle(a, l->obj[i].p, l->obj[i].size);
+	kfree(l);
+}
+
+/* reclaim:  recycles the batches whose grace period has passed */
+static void reclaim (struct kv_arena *a) {
+	struct llist_node *n = llist_del_all(&a->ripe);
+
+	while (n != NULL) {
+		struct kv_limbo *l = llist_entry(n, struct kv_limbo, ripe);
+
+		n = n->next;
+		recycle_limbo(a, l);
+	}
+}
+
+/* limbo_ripe:  RCU callback; no reader can still see batch l's objects, so
+ *              queue it for the arena's next allocation to recycle          */
+static void limbo_ripe (struct rcu_head *rcu) {
+	struct kv_limbo *l = container_of(rcu, struct kv_limbo, rcu);
+
+	llist_add(&l->ripe, &l->arena->ripe);
+}
+
+/* kv_arena_flush:  starts the grace period after which the objects freed so
+ *                  far may be reused */
+void kv_arena_flush (struct kv_arena *a) {
+	if (a->limbo == NULL) return;
+
+	call_rcu(&a->limbo->rcu, limbo_ripe);
+	a->limbo = NULL;
+}
+
+/* kv_arena_alloc:  returns size bytes from arena a, or NULL on failure */
+void *kv_arena_alloc (struct kv_arena *a, size_t size) {
+
+	/* requests the arena does not serve */
+	if (size == 0) return NULL;
+
+	/* take back whatever readers have finished with */
+	if (!llist_empty(&a->ripe)) reclaim(a);
+
+	/* requests too large for a chunk get their own tracked allocation */
+	if (size > KV_ARENA_MAX) {
+		struct kv_big *b = kmalloc(sizeof(struct kv_big) + size, GFP_KERNEL);
+		if (b == NULL) return NULL;
+
+		b->prev = NULL;
+		b->next = a->big;
+		if (a->big != NULL) a->big->prev = b;
+		a->big  = b;
+
+		a->held += sizeof(struct kv_big) + size;
+		a->allocs++;
+		return b + 1;
+	}
+
+	size_t  sz  = ALIGN(size, KV_ARENA_ALIGN);
+	int     cls = sz / KV_ARENA_ALIGN - 1;
+	void   *p   = a->free[cls];
+
+	/* reuse a previously freed object of this size, if there is one */
+	if (p != NULL) {
+		a->free[cls] = *(void **) p;
+		a->allocs++;
+		return p;
+	}
+
+	/* otherwise start a new chunk when the newest one cannot fit the request */
+	if (a->chunks == NULL || a->top + sz > CHUNK_PAYLOAD) {
+		struct kv_chunk *c = kmem_cache_alloc(kv_chunk_cache, GFP_KERNEL);
+		if (c == NULL) return NULL;
+
+		c->next   = a->chunks;
+		a->chunks = c;
+		a->top    = 0;
+		a->held  += KV_ARENA_CHUNK;
+		a->nchunks++;
+	}
+
+	/* and bump the request off the newest chunk */
+	p       = (char *) (a->chunks + 1) + a->top;
+	a->top += sz;
+	a->allocs++;
+
+	return p;
+}
+
+/* kv_arena_need:  how many bytes arena a would grow by to serve the n
+ *                 requests of size[] in turn; objects still waiting out a
+ *                 grace period are not counted on, so this errs high      */
+size_t kv_arena_need (struct kv_arena *a, const size_t *size, int n) {
+	size_t need = 0;
+	size_t top;
+	int    i, j;
+
+	/* take back whatever readers have finished with, as an allocation would */
+	if (!llist_empty(&a->ripe)) reclaim(a);
+
+	top = (a->chunks == NULL) ? CHUNK_PAYLOAD : a->top;
+
+	for (i = 0; i < n; i++) {
+		if (size[i] == 0) continue;
+
+		if (size[i] > KV_ARENA_MAX) {
+			need += sizeof(struct kv_big) + size[i];
+			continue;
+		}
+
+		/* a free list serves as many requests of its class as it holds */
+		size_t  sz = ALIGN(size[i], KV_ARENA_ALIGN);
+		void   *p  = a->free[sz / KV_ARENA_ALIGN - 1];
+
+		for (j = 0; j < i && p != NULL; j++) {
+			if (ALIGN(size[j], KV_ARENA_ALIGN) == sz) p = *(void **) p;
+		}
+		if (p != NULL) continue;
+
+		/* the rest are bumped off the newest chunk, or a new one */
+		if (top + sz > CHUNK_PAYLOAD) {
+			need += KV_ARENA_CHUNK;
+			top   = 0;
+		}
+		top += sz;
+	}
+
+	return need;
+}
+
+/* kv_arena_free:  gives p, which was allocated with size, back to arena a */
+void kv_arena_free (struct kv_arena *a, void *p, size_t size) {
+	if (p == NULL) return;
+
+	a->frees++;
+
+	/* oversized requests leave the arena's list now, and are kfree'd later */
+	if (size > KV_ARENA_MAX) {
+		struct kv_big *b = (struct kv_big *) p - 1;
+
+		if (b->prev != NULL) b->prev->next = b->next;
+		else                 a->big        = b->next;
+		if (b->next != NULL) b->next->prev = b->prev;
+
+		p = b;
+	}
+
+	/* start a new batch when there is none, or the current one is full */
+	if (a->limbo != NULL && a->limbo->n == KV_LIMBO_MAX) kv_arena_flush(a);
+
+	if (a->limbo == NULL) {
+		struct kv_limbo *l = kmalloc(sizeof(struct kv_limbo), GFP_KERNEL);
+
+		/* without a batch, wait out the grace period here instead */
+		if (l == NULL) {
+			synchronize_rcu();
+			recycle(a, p, size);
+			return;
+		}
+
+		l->arena = a;
+		l->n     = 0;
+		a->limbo = l;
+	}
+
+	a->limbo->obj[a->limbo->n].p    = p;
+	a->limbo->obj[a->limbo->n].size = size;
+	a->limbo->n++;
+}
+
+/* kv_arena_release:  frees everything in arena a and leaves it empty */
+void kv_arena_release (struct kv_arena *a) {
+	struct kv_chunk *c = a->chunks;
+	struct kv_big   *b = a->big;
+
+	/* oversized objects awaiting a grace period are freed with their batch;
+	   small ones live in some chunk, so only the chunks are freed */
+	reclaim(a);
+	if (a->limbo != NULL) recycle_limbo(a, a->limbo);
+
+	while (c != NULL) {
+		struct kv_chunk *next = c->next;
+		kmem_cache_free(kv_chunk_cache, c);
+		c = next;
+	}
+
+	/* along with whatever oversized requests are still outstanding */
+	while (b != NULL) {
+		struct kv_big *next = b->next;
+		kfree(b);
+		b = next;
+	}
+
+	memset(a, 0, sizeof(struct kv_arena));
+}
@@ -0,0 +1,101 @@
+/* kv_arena.h -- chunked allocator behind each user's key data
+ *
+ * Every kv_list_h owns an arena from which its list nodes, chain heads and
+ * out-of-line strings are carved.  Small requests are bump-allocated out of
+ * fixed-size chunks and recycled through per-size free lists, so dropping a
+ * whole user only returns its handful of chunks to the slab rather than
+ * every object.  The rare request above KV_ARENA_MAX is kmalloc'd on its
+ * own but still tracked by the arena so that it is released along with it.
+ *
+ * What an arena holds is what it has taken from the slab and kmalloc, not
+ * what it has handed out: freed objects stay on their free lists, and the
+ * chunks under them are kept until the arena is released.
+ *
+ * Readers may still be looking at an object under rcu_read_lock() when it
+ * is freed, so a freed object is only reused (or, if oversized, kfree'd)
+ * after an RCU grace period has passed.
+ */
+
+#ifndef _KV_ARENA_H_
+#define _KV_ARENA_H_
+
+#include <linux/types.h>
+#include <linux/rcupdate.h>
+#include <linux/llist.h>
+
+#define KV_ARENA_CHUNK   4096  /* bytes per chunk, header included          */
+#define KV_ARENA_ALIGN   8     /* every allocation is rounded up to this    */
+#define KV_ARENA_MAX     256   /* largest request served from a chunk       */
+#define KV_ARENA_CLASSES (KV_ARENA_MAX / KV_ARENA_ALIGN)
+#define KV_LIMBO_MAX     30    /* frees recorded per grace period batch    */
+
+/* header of each chunk; the chunk's payload follows it directly            */
+struct kv_chunk {
+	struct kv_chunk *next;
+};
+
+/* header of a request too large for a chunk; the request follows it       */
+struct kv_big {
+	struct kv_big *next;
+	struct kv_big *prev;
+};
+
+/* objects freed together, which wait out one RCU grace period before the
+ * arena may hand them out again; an oversized object is recorded by its
+ * kv_big header                                                            */
+struct kv_limbo {
+	struct rcu_head    rcu;
+	struct llist_node  ripe;                   /* on the arena's ripe list*/
+	struct kv_arena   *arena;
+	int                n;
+	struct {
+		void   *p;
+		size_t  size;
+	}                  obj[KV_LIMBO_MAX];
+};
+
+/* a zero-filled kv_arena is a valid, empty arena                           */
+struct kv_arena {
+	struct kv_chunk   *chunks;                 /* newest chunk first      */
+	size_t             top;                    /* bytes used in newest    */
+	void              *free[KV_ARENA_CLASSES]; /* freed objects, by size  */
+	struct kv_big     *big;                    /* oversized requests      */
+	size_t             held;                   /* bytes of chunks, and of
+	                                              oversized requests not
+	                                              yet kfree'd             */
+	struct kv_limbo   *limbo;                  /* frees not yet deferred  */
+	struct llist_head  ripe;                   /* limbos whose grace
+	                                              period has passed       */
+	unsigned long      nchunks;                /* chunks held             */
+	unsigned long      allocs;                 /* objects handed out and  */
+	unsigned long      frees;                  /* given back, ever        */
+};
+
+/* kv_arena_init_cache:  creates the slab cache that supplies arena chunks  */
+int   kv_arena_init_cache (void);
+
+/* kv_arena_close_cache:  destroys the chunk cache after every arena is gone*/
+void  kv_arena_close_cache (void);
+
+/* kv_arena_alloc:  returns size bytes from arena a, or NULL on failure     */
+void *kv_arena_alloc (struct kv_arena *a, size_t size);
+
+/* kv_arena_need:  how many bytes arena a would grow by to serve the n
+ *                 requests of size[] in turn, as kv_arena_alloc would     */
+size_t kv_arena_need (struct kv_arena *a, const size_t *size, int n);
+
+/* kv_arena_free:  gives p, which was allocated with size, back to arena a;
+ *                 p stays readable until a grace period after the next
+ *                 kv_arena_flush                                          */
+void  kv_arena_free (struct kv_arena *a, void *p, size_t size);
+
+/* kv_arena_flush:  starts the grace period after which the objects freed so
+ *                  far may be reused; called at the end of each update     */
+void  kv_arena_flush (struct kv_arena *a);
+
+/* kv_arena_release:  frees everything in arena a and leaves it empty; the
+ *                    caller must first rcu_barrier() so that no flushed
+ *                    batch is still waiting on its grace period           */
+void  kv_arena_release (struct kv_arena *a);
+
+#endif /* _KV_ARENA_H_ */
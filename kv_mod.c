@@ -40,6 +40,15 @@ Summary of Modifications
 #include <linux/cdev.h>
 #include <linux/sched.h>
 #include <linux/cred.h>
+#include <linux/ctype.h>	/* isspace() */
+#include <linux/device.h>	/* class_create(), device_create() */
+#include <linux/prefetch.h>	/* prefetch() */
+#include <linux/mm.h>		/* remap_vmalloc_range() */
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/mmu_context.h>	/* use_mm() */
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/uio.h>		/* iov_iter */
 
 #include <asm/uaccess.h>	/* copy_*_user */
 
@@ -51,15 +60,32 @@ Summary of Modifications
 int kv_mod_major   = KV_MOD_MAJOR;
 int kv_mod_minor   = 0;
 int kv_mod_nr_devs = KV_MOD_NR_DEVS;
-
-char seek_key[80];
+int kv_mod_max_keys = KV_MOD_MAX_KEYS;
+int kv_mod_set_mode[KV_MOD_MAX_DEVS];	/* 0 (multiset) unless given */
+int kv_mod_ordered[KV_MOD_MAX_DEVS];	/* 0 (no sorted index) unless given */
+int kv_mod_stream[KV_MOD_MAX_DEVS];	/* 0 (a pair per read) unless given */
+unsigned long kv_mod_soft_quota = 0;	/* bytes per user, 0 for no quota */
+unsigned long kv_mod_hard_quota = 0;
 
 module_param(kv_mod_major,   int, S_IRUGO);
 module_param(kv_mod_minor,   int, S_IRUGO);
 module_param(kv_mod_nr_devs, int, S_IRUGO);
-void fix_uid(int *idnum);
+module_param(kv_mod_max_keys, int, S_IRUGO);
+MODULE_PARM_DESC(kv_mod_max_keys, "Most unique keys any one user may hold");
+module_param_array(kv_mod_set_mode, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(kv_mod_set_mode, "Per device: 1 if a key holds each value at most once");
+module_param_array(kv_mod_ordered, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(kv_mod_ordered, "Per device: 1 to keep keys sorted for KV_MOD_IOCXSCAN");
+module_param_array(kv_mod_stream, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(kv_mod_stream, "Per device: 1 if files are opened in stream mode");
+module_param(kv_mod_soft_quota, ulong, S_IRUGO);
+MODULE_PARM_DESC(kv_mod_soft_quota, "Bytes per user past which inserts are logged (0: none)");
+module_param(kv_mod_hard_quota, ulong, S_IRUGO);
+MODULE_PARM_DESC(kv_mod_hard_quota, "Bytes per user past which inserts fail with EDQUOT (0: none)");
 void insert(struct kv_list **data, const char __user *buf);
-int get_user_id(void);
+uid_t get_user_id(void);
+char *next_token(char **pos, char *end, int *len);
+static void kv_mod_kick_work(struct work_struct *work);
 
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet modified K. Shomper and further modified by Rich Lively and Tim Froberg");
@@ -68,22 +94,119 @@ MODULE_LICENSE("Dual BSD/GPL");
 /* the set of devices allocated in kv_mod_init_module */
 struct kv_mod_dev *kv_mod_devices = NULL;
 
+/* the sysfs class under which each device's statistics appear */
+struct class *kv_mod_class = NULL;
+
 /*
- * Release the memory held by the kv_mod device; must be called with the device
- * semaphore held.  Requires that dev not be NULL
+ * Release the memory held by the kv_mod device; must be called once no file
+ * has the device open.  Requires that dev not be NULL
  */
 int remove_data(struct kv_mod_dev *dev) {
     close_vault(dev->data);
+    kfree(dev->data);
 	dev->data = NULL;
 
 	return 0;
 }
 
+/*
+ * cursor_set:  points f's cursor at l, a pair of user's found under RCU (or
+ *              the user's lock) after gen was read, keeping a copy of the
+ *              pair so that it can be found again; called with f->lock held
+ */
+static void cursor_set(struct kv_mod_file *f, struct kv_list_h *user,
+                       unsigned long gen, struct kv_list *l) {
+    f->uid = user->uid;
+    f->pos = l;
+    f->gen = gen;
+    if (l == NULL) return;
+
+    f->hstamp = l->head->stamp;
+    f->stamp  = l->stamp;
+    f->klen   = l->kv.klen;
+    f->vlen   = l->kv.vlen;
+    memcpy(f->pair, kv_key(l), f->klen);
+    memcpy(f->pair + f->klen, kv_val(l), f->vlen);
+}
+
+/*
+ * cursor_get:  returns the pair at f's cursor, setting *gen to the user's
+ *              generation it is valid in.  If pairs were deleted since the
+ *              cursor was set, the pair is looked up again; when it is gone,
+ *              the cursor moves on to the pair that followed it, so a walk
+ *              neither repeats nor skips pairs (see resume_pair).  A file
+ *              used by another uid starts over at that user's first pair.  Called under RCU (or the user's
+ *              lock) with f->lock held.
+ */
+static struct kv_list *cursor_get(struct kv_mod_file *f, struct key_vault *v,
+                                  struct kv_list_h *user, unsigned long *gen) {
+    struct kv_list *l;
+
+    *gen = smp_load_acquire(&user->gen);
+
+    if (f->uid != user->uid) {
+        cursor_set(f, user, *gen, first_key(v, user->uid));
+        return f->pos;
+    }
+
+    if (f->pos == NULL || f->gen == *gen) return f->pos;
+
+    l = resume_pair(v, f->uid, f->pair, f->klen, f->pair + f->klen, f->vlen,
+                    f->hstamp, f->stamp);
+
+    cursor_set(f, user, *gen, l);
+    return l;
+}
+
+/*
+ * cursor_seek:  points f's cursor at uid's pair key val -- or, when val is
+ *               NULL, at the key's first value -- and returns the length of
+ *               the pair found there, which is also stored in out (of at least
+ *               KV_PAIR_MAX bytes) as "key val\0" unless out is NULL.  Returns
+ *               0, leaving the cursor at the end, if there is no such pair.
+ */
+static int cursor_seek(struct kv_mod_file *f, uid_t uid, const char *key,
+                       int klen, const char *val, int vlen, char *out) {
+    struct key_vault *v   = f->dev->data;
+    struct kv_list   *l;
+    int               len = 0;
+    int               i;
+
+    rcu_read_lock();
+    struct kv_list_h *user = find_user(v, uid, FALSE);
+    if (user == NULL) goto out;
+
+    /* the generation is read first, so a delete racing with the lookup
+       sends the cursor to look its pair up again */
+    unsigned long gen = smp_load_acquire(&user->gen);
+
+    if (val != NULL) l = find_key_val(v, uid, key, klen, val, vlen);
+    else             l = find_key(v, uid, key, klen, &i);
+
+    spin_lock(&f->lock);
+    cursor_set(f, user, gen, l);
+    spin_unlock(&f->lock);
+
+    if (l == NULL) goto out;
+
+    len = klen + 1 + l->kv.vlen + 1;
+    if (out != NULL) {
+        memcpy(out, kv_key(l), klen);
+        out[klen] = ' ';
+        memcpy(out + klen + 1, kv_val(l), l->kv.vlen);
+        out[len-1] = '\0';
+    }
+  out:
+    rcu_read_unlock();
+    return len;
+}
+
 /*
  * Open: to open the device is to initialize it for the remaining methods.
  */
 int kv_mod_open(struct inode *inode, struct file *filp) {
-    struct kv_mod_dev *dev;
+    struct kv_mod_dev  *dev;
+    struct kv_mod_file *f;
     /* we need the kv_mod_dev object (dev), but the required prototpye
       for the open method is that it receives a pointer to an inode.
       now an inode contains a struct cdev (the field is called
@@ -93,37 +216,52 @@ int kv_mod_open(struct inode *inode, struct file *filp) {
     */
     dev = container_of(inode->i_cdev, struct kv_mod_dev, cdev);
 
-    /* so that we don't need to use the container_of() macro repeatedly,
-		we save the handle to dev in the file's private_data for other methods.
-	 */
-    filp->private_data = dev;
+    /* each open file gets a cursor of its own, which is kept with the handle
+       to dev in the file's private_data for the other methods; zeroed, so
+       the seek target is empty until KV_MOD_IOCSKEY sets one */
+    f = kzalloc(sizeof(struct kv_mod_file), GFP_KERNEL);
+    if (f == NULL) return -ENOMEM;
 
-    if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+    f->dev  = dev;
+    f->mode = dev->mode;
+    f->uid  = get_user_id();
+    f->pos  = NULL;
+    f->gen  = 0;
+    f->ring = NULL;
+    spin_lock_init(&f->lock);
+    mutex_init(&f->ring_lock);
+    init_waitqueue_head(&f->ring_wait);
+    INIT_WORK(&f->kick, kv_mod_kick_work);
+    filp->private_data = f;
 
-    int uid = get_user_id();
-    /* no keys in the vault, so set the filepointer to null */
-    if (num_pairs(dev->data, uid) == 0 ) {
-        dev->data->ukey_data[uid-1].fp = NULL;
-    }
+    /* the cursor starts at the first key-value pair, if the user has any */
+    rcu_read_lock();
+    struct kv_list_h *user = find_user(dev->data, f->uid, FALSE);
+
+    if (user != NULL) {
+        unsigned long gen = smp_load_acquire(&user->gen);
 
-    /* there are keys, so set the filepointer to the first key-value pair */
-    else {
-        dev->data->ukey_data[uid-1].fp = dev->data->ukey_data[uid-1].data[0];
+        spin_lock(&f->lock);
+        cursor_set(f, user, gen, first_key(dev->data, f->uid));
+        spin_unlock(&f->lock);
     }
+    rcu_read_unlock();
 
-    /* release the semaphore and return */
-    up(&dev->sem);
 	return 0;
 }
 
 /*
- * Release: release is the opposite of open, so it deallocates any
- *          memory allocated by kv_mod_open and shuts down the device.
- *          since open didn't allocate anything and our device exists
- *          only in memory, there are no actions to take here.
+ * Release: release is the opposite of open, so it deallocates the
+ *          cursor allocated by kv_mod_open.  Our device exists only
+ *          in memory, so there is nothing else to shut down.
  */
 int kv_mod_release(struct inode *inode, struct file *filp) {
-	/* Nothing to release; stub */
+    struct kv_mod_file *f = filp->private_data;
+
+    /* no mapping of the ring outlives the file */
+    vfree(f->ring);
+    if (f->ring_mm != NULL) mmdrop(f->ring_mm);
+    kfree(f);
     return 0;
 }
 
@@ -135,31 +273,150 @@ int kv_mod_release(struct inode *inode, struct file *filp) {
  *       should therefore not be trusted.
  */
 
-ssize_t kv_mod_read(struct file *filp, char __user *buf, size_t count,
-                    loff_t *f_pos) {
-    ssize_t retval = -ENOMEM;
-    struct kv_mod_dev *dev = filp->private_data;
-    struct key_vault *vault = dev->data;
-    /* acquire semephore */
-    if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
-    /* get 1-indexed user id */
-    int uid = get_user_id();
-    /* get key-val pair at current fp for this user */
-    struct kv_list *curr = vault->ukey_data[uid-1].fp;
+/*
+ * read_stream:  the read of a file in stream mode, which stores as many whole
+ *               "key val\n" lines as fit in to, a chunk at a time, and
+ *               returns the bytes stored; 0 means the cursor is at the end.
+ *               The lines run on across to's segments as if it were one buffer.
+ */
+static ssize_t read_stream(struct kv_mod_file *f, struct iov_iter *to) {
+    struct key_vault *vault = f->dev->data;
+    uid_t             uid   = get_user_id();
+    size_t            count = iov_iter_count(to);
+    size_t            done  = 0;
+    size_t            size  = min(count, (size_t) KV_MOD_STREAM_CHUNK);
+    ssize_t           err   = 0;
+    unsigned long     gen;
+
+    /* each chunk is assembled under RCU, then copied out in one go */
+    char *kbuf = kmalloc(size, GFP_KERNEL);
+    if (kbuf == NULL) return -ENOMEM;
+
+    while (done < count) {
+        size_t room = min(count - done, size);
+        size_t len  = 0;
+
+        rcu_read_lock();
+        struct kv_list_h *user = find_user(vault, uid, FALSE);
+        if (user == NULL) {
+            rcu_read_unlock();
+            break;
+        }
+
+        spin_lock(&f->lock);
+        struct kv_list *l = cursor_get(f, vault, user, &gen);
+
+        /* take whole pairs while they fit */
+        while (l != NULL) {
+            int klen = l->kv.klen;
+            int vlen = l->kv.vlen;
+
+            if (len + klen + 1 + vlen + 1 > room) break;
+
+            memcpy(kbuf + len, kv_key(l), klen);
+            kbuf[len + klen] = ' ';
+            memcpy(kbuf + len + klen + 1, kv_val(l), vlen);
+            kbuf[len + klen + 1 + vlen] = '\n';
+            len += klen + 1 + vlen + 1;
+
+            l = next_key(vault, uid, l);
+        }
+
+        /* the cursor is moved once per chunk, not once per pair */
+        if (len > 0) cursor_set(f, user, gen, l);
+        spin_unlock(&f->lock);
+        rcu_read_unlock();
+
+        /* a pair too long for what is left ends the read; too long for the
+           whole buffer, it could never be read */
+        if (len == 0) {
+            if (l != NULL) err = -EINVAL;
+            break;
+        }
+
+        if (copy_to_iter(kbuf, len, to) != len) {
+            err = -EFAULT;
+            break;
+        }
+        done += len;
+
+        /* the end of the user's pairs */
+        if (l == NULL) break;
+    }
+
+    kfree(kbuf);
+
+    /* what was stored is reported before any error met after it */
+    return (done > 0) ? done : err;
+}
+
+/*
+ * read_pair:  assembles the pair at f's cursor into kbuf, of KV_PAIR_MAX
+ *             bytes, as "key val\0" and moves the cursor past it.  Returns
+ *             the length stored, 0 if there is no pair to read, or -EINVAL
+ *             if the pair needs more than room bytes.
+ */
+static int read_pair(struct kv_mod_file *f, char *kbuf, size_t room) {
+    struct key_vault *vault = f->dev->data;
+    unsigned long gen;
+    int len = 0;
+
+    rcu_read_lock();
+    /* get the user id and that user's key data */
+    uid_t             uid  = get_user_id();
+    struct kv_list_h *user = find_user(vault, uid, FALSE);
+    if (user == NULL) goto out;
+
+    /* threads may share the file, so its cursor is held while it advances */
+    spin_lock(&f->lock);
+    /* get key-val pair at this file's cursor */
+    struct kv_list *curr = cursor_get(f, vault, user, &gen);
     /* nothing to read for the user */
-    if (curr == NULL) {
-        retval = 0;
-        goto out;
+    if (curr == NULL) goto unlock;
+
+    /* the pair, a separating space and a trailing NUL must fit in room */
+    int klen = curr->kv.klen;
+    int vlen = curr->kv.vlen;
+    if (room < klen + 1 + vlen + 1) {
+        len = -EINVAL;
+        goto unlock;
     }
-    /* extract the key and value from the filepointer */
-    char key[MAX_KEY_SIZE];
-    char val[MAX_VAL_SIZE];
-    strncpy(key, curr->kv.key, 80);
-    strncpy(val, curr->kv.val, 80);
 
     /* assemble pair into local buffer */
-    char kbuf[80];
-    snprintf(kbuf, 80, "%s %s", key, val);
+    len = klen + 1 + vlen + 1;
+    memcpy(kbuf, kv_key(curr), klen);
+    kbuf[klen] = ' ';
+    memcpy(kbuf + klen + 1, kv_val(curr), vlen);
+    kbuf[len-1] = '\0';
+
+    /* update the cursor */
+    cursor_set(f, user, gen, next_key(vault, uid, curr));
+  unlock:
+    spin_unlock(&f->lock);
+  out:
+    rcu_read_unlock();
+    return len;
+}
+
+ssize_t kv_mod_read(struct file *filp, char __user *buf, size_t count,
+                    loff_t *f_pos) {
+    ssize_t retval = 0;
+    struct kv_mod_file *f = filp->private_data;
+
+    if (f->mode & KV_MOD_STREAM) {
+        struct iovec    iov = { .iov_base = buf, .iov_len = count };
+        struct iov_iter to;
+
+        iov_iter_init(&to, READ, &iov, 1, count);
+        return read_stream(f, &to);
+    }
+
+    /* reads take no lock: the pair is assembled under RCU, so it must
+       go into a buffer large enough for any pair, allocated beforehand */
+    char *kbuf = kmalloc(KV_PAIR_MAX, GFP_KERNEL);
+    if (kbuf == NULL) return -ENOMEM;
+
+    int len = read_pair(f, kbuf, count);
 
    /* the copy below originally had 80 where 79 appears and did not have
        the '+1' part.  As a result, length of kbuf characters were copied
@@ -167,26 +424,280 @@ ssize_t kv_mod_read(struct file *filp, char __user *buf, size_t count,
        buf was not properly NULL terminated.  KAS
      */
     /* copy local buff to user buffer */
-    if (copy_to_user(buf, kbuf, strnlen(kbuf, 79)+1)) {
-		retval = -EFAULT;
-		goto out;
-	}
+    if (len > 0) {
+        /* succesfully wrote one key-value pair so return 1 */
+        retval = copy_to_user(buf, kbuf, len) ? -EFAULT : 1;
+    } else {
+        retval = len;
+    }
 
-    /* update the filepointer */
-    vault->ukey_data[uid-1].fp = next_key(vault, uid, curr);
-    /* succesfully wrote one key-value pair so return 1 */
-    retval = 1;
-  out:
-    /* release semaphore and return */
-    up(&dev->sem);
+    kfree(kbuf);
+    return retval;
+}
+
+/*
+ * kv_mod_read_iter:  readv() and its kin.  In stream mode the lines run on
+ *                    across the segments; otherwise each segment gets the
+ *                    "key val\0" pair a read() of it would, so that one call
+ *                    reads many pairs.  Like read(), returns the pairs read.
+ */
+ssize_t kv_mod_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct kv_mod_file *f = iocb->ki_filp->private_data;
+    ssize_t retval = 0;
+
+    if (f->mode & KV_MOD_STREAM) return read_stream(f, to);
+
+    char *kbuf = kmalloc(KV_PAIR_MAX, GFP_KERNEL);
+    if (kbuf == NULL) return -ENOMEM;
+
+    while (iov_iter_count(to) > 0) {
+        size_t seg = iov_iter_single_seg_count(to);
+
+        /* an empty segment holds no pair, and is stepped over */
+        if (seg == 0) {
+            iov_iter_advance(to, 0);
+            continue;
+        }
+
+        int len = read_pair(f, kbuf, seg);
+        if (len <= 0) {
+            /* a pair too long for its segment stops the read where it is */
+            if (retval == 0) retval = len;
+            break;
+        }
+
+        if (copy_to_iter(kbuf, len, to) != len) {
+            if (retval == 0) retval = -EFAULT;
+            break;
+        }
+        /* the rest of the segment is left as it was */
+        iov_iter_advance(to, seg - len);
+        retval++;
+    }
+
+    kfree(kbuf);
     return retval;
 }
 
+/* quota_notice:  reports a user past the soft quota, who may go on inserting */
+static void quota_notice(struct key_vault *v, uid_t uid) {
+    long bytes;
+
+    if (v->soft_quota == 0) return;
+
+    rcu_read_lock();
+    bytes = num_bytes(v, uid);
+    rcu_read_unlock();
+
+    if (bytes > v->soft_quota) {
+        printk_ratelimited(KERN_NOTICE "kv_mod: uid %u is over its soft quota\n",
+                           uid);
+    }
+}
+
+/*
+ * write_line:  applies one line [p, end) of a stream write: "key val" inserts
+ *              the pair and "- key val" deletes it, while a blank line does
+ *              nothing.  Returns 1 after an insert (setting *key and *val to
+ *              the pair), 0 otherwise, or -errno; called with the user's lock.
+ */
+static int write_line(struct key_vault *v, uid_t uid, char *p, char *end,
+                      char **key, int *klen, char **val, int *vlen) {
+    char *tok[4];
+    int   len[4];
+    int   n;
+
+    for (n = 0; n < 4; n++) {
+        tok[n] = next_token(&p, end, &len[n]);
+        if (tok[n] == NULL) break;
+    }
+
+    switch (n) {
+      case 0:
+          return 0;
+      case 2:
+          n = insert_pair(v, uid, tok[0], len[0], tok[1], len[1]);
+          if (n < 0) return n;
+
+          *key = tok[0]; *klen = len[0];
+          *val = tok[1]; *vlen = len[1];
+          return 1;
+      case 3:
+          if (len[0] != 1 || tok[0][0] != '-') return -EINVAL;
+          delete_pair(v, uid, tok[1], len[1], tok[2], len[2]);
+          return 0;
+      default:
+          return -EINVAL;
+    }
+}
+
+/*
+ * write_stream:  the write of a file in stream mode, which applies each line
+ *                of from in turn (see write_line), all under one hold of the
+ *                user's lock, and returns the bytes of the lines applied.
+ *                from is copied in a chunk at a time, each byte just once; a
+ *                line that runs past a chunk, or a segment, is finished with
+ *                the next one.
+ */
+static ssize_t write_stream(struct kv_mod_file *f, struct iov_iter *from) {
+    struct key_vault *vault = f->dev->data;
+    uid_t             uid   = get_user_id();
+    size_t            count = iov_iter_count(from);
+    size_t            done  = 0;  /* bytes of the lines applied            */
+    size_t            have  = 0;  /* bytes in kbuf, from the next line on  */
+    ssize_t           err   = 0;
+    char             *key, *val;
+    int               klen, vlen;
+
+    if (count == 0) return 0;
+
+    char *kbuf = kmalloc(KV_MOD_STREAM_CHUNK, GFP_KERNEL);
+    if (kbuf == NULL) return -ENOMEM;
+
+    struct kv_list_h *user = find_user(vault, uid, TRUE);
+    if (user == NULL) {
+        kfree(kbuf);
+        return -ENOMEM;
+    }
+
+    if (mutex_lock_interruptible(&user->lock)) {
+        kfree(kbuf);
+        return -ERESTARTSYS;
+    }
+
+    while (done < count) {
+        size_t n = min(count - done - have, (size_t) KV_MOD_STREAM_CHUNK - have);
+
+        if (copy_from_iter(kbuf + have, n, from) != n) {
+            err = -EFAULT;
+            break;
+        }
+        have += n;
+
+        /* the last line of the buffer needs no newline */
+        int   last     = (done + have == count);
+        int   inserted = 0;
+        char *p        = kbuf;
+        char *end      = kbuf + have;
+
+        while (p < end) {
+            char *nl = memchr(p, '\n', end - p);
+            if (nl == NULL && !last) break;
+
+            int rc = write_line(vault, uid, p, (nl == NULL) ? end : nl,
+                                &key, &klen, &val, &vlen);
+            if (rc < 0) {
+                err = rc;
+                break;
+            }
+            inserted |= rc;
+            p = (nl == NULL) ? end : nl + 1;
+        }
+
+        /* the cursor goes to the last pair inserted, while its key and
+           value are still in the chunk */
+        if (inserted) {
+            struct kv_list *l = find_key_val(vault, uid, key, klen, val, vlen);
+
+            spin_lock(&f->lock);
+            cursor_set(f, user, user->gen, l);
+            spin_unlock(&f->lock);
+        }
+
+        done += p - kbuf;
+        if (err < 0) break;
+
+        /* a whole chunk without a newline holds no pair */
+        if (p == kbuf) {
+            err = -EINVAL;
+            break;
+        }
+
+        have = end - p;
+        memmove(kbuf, p, have);
+    }
+
+    mutex_unlock(&user->lock);
+    kfree(kbuf);
+
+    quota_notice(vault, uid);
+
+    /* what was applied is reported before any error met after it */
+    return (done > 0) ? done : err;
+}
+
+/*
+ * write_pair:  the write of one pair from kbuf, which is NUL-terminated: an
+ *              empty kbuf deletes the pair at f's cursor, moving the cursor
+ *              past it, else "key val" inserts the pair and moves the cursor
+ *              to it.  Returns 1 or -errno, -ENOMEM if there was nothing to
+ *              delete, as write() has always reported it; called with the
+ *              user's lock.
+ */
+static int write_pair(struct kv_mod_file *f, struct kv_list_h *user,
+                      char *kbuf) {
+    struct key_vault *vault = f->dev->data;
+    uid_t             uid   = user->uid;
+    size_t            n     = strlen(kbuf);
+    unsigned long     gen;
+
+    /* if an empty buffer, delete; else insert */
+    if (n == 0) {
+        /* take the pair at the cursor, moving the cursor past it before
+           it is deleted; readers of this file advance it concurrently */
+        spin_lock(&f->lock);
+        struct kv_list *curr = cursor_get(f, vault, user, &gen);
+        if (curr != NULL) cursor_set(f, user, gen, next_key(vault, uid, curr));
+        spin_unlock(&f->lock);
+
+        /* nothing to delete */
+        if (curr == NULL) return -ENOMEM;
+
+        /* delete the pair */
+        delete_pair(vault, uid, kv_key(curr), curr->kv.klen,
+                    kv_val(curr), curr->kv.vlen);
+        return 1;
+    }
+
+    /* extract key and value from the buffer */
+    char *pos = kbuf;
+    int   klen, vlen;
+    char *key = next_token(&pos, kbuf + n, &klen);
+    char *val = next_token(&pos, kbuf + n, &vlen);
+
+    /* a pair needs both a key and a value */
+    if (val == NULL) return -EINVAL;
+
+    /* insert the key-value pair */
+    int rc = insert_pair(vault, uid, key, klen, val, vlen);
+    /* failed to insert */
+    if (rc < 0) return rc;
+
+    quota_notice(vault, uid);
+
+    /* update the cursor to the inserted item */
+    struct kv_list *l = find_key_val(vault, uid, key, klen, val, vlen);
+
+    spin_lock(&f->lock);
+    cursor_set(f, user, user->gen, l);
+    spin_unlock(&f->lock);
+
+    return 1;
+}
+
 ssize_t kv_mod_write(struct file *filp, const char __user *buf, size_t count,
                      loff_t *f_pos) {
-    struct kv_mod_dev *dev = filp->private_data;
+    struct kv_mod_file *f = filp->private_data;
     ssize_t retval = -ENOMEM;
-    if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+
+    if (f->mode & KV_MOD_STREAM) {
+        struct iovec    iov = { .iov_base = (void __user *) buf,
+                                .iov_len  = count };
+        struct iov_iter from;
+
+        iov_iter_init(&from, WRITE, &iov, 1, count);
+        return write_stream(f, &from);
+    }
 
     /* this is where the actual "write" occurs, when we copy from the
     * the user-supplied buffer into the in-memory data area.  This copy is
@@ -194,68 +705,886 @@ ssize_t kv_mod_write(struct file *filp, const char __user *buf, size_t count,
     * transfer of data from user space data structures to kernel space
     * data structures.
     */
-    char kbuf[80];
-	if (copy_from_user(kbuf, buf, strnlen(buf, 80))) {
+    size_t n    = min(count, (size_t) KV_PAIR_MAX - 1);
+    char  *kbuf = kmalloc(n + 1, GFP_KERNEL);
+    if (kbuf == NULL) goto out;
+
+	if (copy_from_user(kbuf, buf, n)) {
 		retval = -EFAULT;
 		goto out;
 	}
 
-    kbuf[strnlen(buf, 80)] = '\0'; 
+    /* the pair ends at the first NUL, or at the end of what was written */
+    kbuf[n] = '\0';
 
-    /* get the key vault, one-indexed user id, and the user's filepointer */
-    struct key_vault *vault = dev->data;
-	int uid = get_user_id();
-    struct kv_list *curr = vault->ukey_data[uid-1].fp;
-
-    /* if an empty buffer, delete; else insert */
-    if (strcmp(kbuf, "") == 0) {
-        /* nothing to delete */
-        if (curr == NULL) goto out;
+    /* get the key vault, user id, and the user's key data */
+    struct key_vault *vault = f->dev->data;
+	uid_t             uid   = get_user_id();
+    struct kv_list_h *user  = find_user(vault, uid, TRUE);
+    if (user == NULL) goto out;
 
-        /* update the filepointer */
-        vault->ukey_data[uid-1].fp = next_key(vault, uid, curr);
-        /* delete the pair */
-        delete_pair(vault, uid, curr->kv.key, curr->kv.val);
-        /* will return 1 because 1 pair was successfully deleted */
-        retval = 1;
-    }
-
-    /* insert key-value pair */
-    else {
-        /* extract key and value from the buffer */
-        char key[MAX_KEY_SIZE];
-        char val[MAX_VAL_SIZE];
-        sscanf(kbuf, "%s %s", key, val);
-        /* insert the key-value pair */
-        int rc = insert_pair(vault, uid, key, val);
-        /* successful insert so set retval to 1 because one pair was successfully written */
-        if (rc) retval = 1;
-        /* failed to insert */
-        else goto out;
-
-        /* update the file pointer to the inserted item */
-        vault->ukey_data[uid-1].fp = find_key_val(vault, uid, key, val);
+    /* only the caller's own key data is locked, so other users go on */
+    if (mutex_lock_interruptible(&user->lock)) {
+        retval = -ERESTARTSYS;
+        goto out;
     }
-	
-	/* release the semaphore and return */
+
+    /* will return 1 because 1 pair was successfully written or deleted */
+    retval = write_pair(f, user, kbuf);
+
+	/* release the user's lock and return */
+    mutex_unlock(&user->lock);
   out:
-	up(&dev->sem);
+    kfree(kbuf);
 	return retval;
 }
 
-/* a crude method for adjusting the user id to close the gap between the id of root and users */
-void fix_uid(int *id) {
-	if (*id == 0) *id = 1;
-	else *id -= 998;
+/*
+ * kv_mod_write_iter:  writev() and its kin.  In stream mode the lines run on
+ *                     across the segments; otherwise each segment is written
+ *                     as a write() of it would be, one pair apiece, all under
+ *                     one hold of the user's lock.  Like write(), returns the
+ *                     pairs written or deleted; a segment that fails, as one
+ *                     with nothing to delete does, ends the call, whose error
+ *                     is returned only if no pair came before it.
+ */
+ssize_t kv_mod_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct kv_mod_file *f = iocb->ki_filp->private_data;
+    struct key_vault *vault = f->dev->data;
+    uid_t uid = get_user_id();
+    ssize_t retval = 0;
+
+    if (f->mode & KV_MOD_STREAM) return write_stream(f, from);
+
+    char *kbuf = kmalloc(KV_PAIR_MAX, GFP_KERNEL);
+    if (kbuf == NULL) return -ENOMEM;
+
+    struct kv_list_h *user = find_user(vault, uid, TRUE);
+    if (user == NULL) {
+        kfree(kbuf);
+        return -ENOMEM;
+    }
+
+    if (mutex_lock_interruptible(&user->lock)) {
+        kfree(kbuf);
+        return -ERESTARTSYS;
+    }
+
+    while (iov_iter_count(from) > 0) {
+        size_t seg = iov_iter_single_seg_count(from);
+        size_t n   = min(seg, (size_t) KV_PAIR_MAX - 1);
+
+        /* an empty segment holds no pair, and is stepped over; a segment
+           starting with a NUL is the one that deletes */
+        if (seg == 0) {
+            iov_iter_advance(from, 0);
+            continue;
+        }
+
+        if (copy_from_iter(kbuf, n, from) != n) {
+            if (retval == 0) retval = -EFAULT;
+            break;
+        }
+        iov_iter_advance(from, seg - n);
+        kbuf[n] = '\0';
+
+        int rc = write_pair(f, user, kbuf);
+        if (rc < 0) {
+            if (retval == 0) retval = rc;
+            break;
+        }
+        retval += rc;
+    }
+
+    mutex_unlock(&user->lock);
+    kfree(kbuf);
+    return retval;
 }
 
-/* get's the current user's id; automatically calls fix_uid */
-int get_user_id(void) {
-    int id = get_current_user()->uid.val;
-    fix_uid(&id);
-    return id;
+/* returns the next whitespace-delimited token in [*pos, end), setting len to
+ * its length and advancing *pos past it; returns NULL if none remains */
+char *next_token(char **pos, char *end, int *len) {
+    char *p = *pos;
+    char *tok;
+
+    /* skip leading whitespace */
+    while (p < end && isspace(*p)) p++;
+    if (p == end) return NULL;
+
+    /* the token runs to the next whitespace character (or end) */
+    tok = p;
+    while (p < end && !isspace(*p)) p++;
+
+    *len = p - tok;
+    *pos = p;
+    return tok;
 }
 
+/* get's the current user's id, which keys the vault's map of users */
+uid_t get_user_id(void) {
+    return from_kuid(&init_user_ns, current_uid());
+}
+
+/*
+ * Range scan:  stores the caller's pairs in the range described by *uscan,
+ * in key order, into the caller's buffer (see struct kv_mod_scan).  Only a
+ * device loaded with kv_mod_ordered set keeps the index this needs.
+ */
+static long kv_mod_scan(struct kv_mod_dev *dev, struct kv_mod_scan __user *uscan) {
+    struct kv_mod_scan scan;
+    struct kv_head    *h;
+    struct kv_list    *l;
+    long               retval = 0;
+
+    if (!(dev->data->flags & KV_VAULT_ORDERED)) return -EOPNOTSUPP;
+
+    if (copy_from_user(&scan, uscan, sizeof(scan))) return -EFAULT;
+    if (scan.lo_len > MAX_KEY_SIZE || scan.hi_len > MAX_KEY_SIZE ||
+        scan.next_len > MAX_KEY_SIZE || (scan.next_len && !scan.next)) return -EINVAL;
+
+    int prefix  = scan.flags & KV_MOD_SCAN_PREFIX;
+    int bounded = !prefix && scan.hi != 0;
+
+    /* fetch both bounds and the resume key, which are no longer than a key */
+    char *lo = kmalloc(3 * MAX_KEY_SIZE, GFP_KERNEL);
+    if (lo == NULL) return -ENOMEM;
+    char *hi   = lo + MAX_KEY_SIZE;
+    char *next = hi + MAX_KEY_SIZE;
+
+    if (copy_from_user(lo, (char __user *)(unsigned long) scan.lo, scan.lo_len) ||
+        (bounded &&
+         copy_from_user(hi, (char __user *)(unsigned long) scan.hi, scan.hi_len)) ||
+        copy_from_user(next, (char __user *)(unsigned long) scan.next, scan.next_len)) {
+        kfree(lo);
+        return -EFAULT;
+    }
+
+    char __user *out  = (char __user *)(unsigned long) scan.buf;
+    u32          room = scan.buf_len;
+    int          resume = scan.next_len > 0;
+
+    scan.count  = 0;
+    scan.flags &= ~KV_MOD_SCAN_MORE;
+
+    /* a user with no key data has nothing to scan */
+    uid_t             uid  = get_user_id();
+    struct kv_list_h *user = find_user(dev->data, uid, FALSE);
+    if (user == NULL) goto done;
+
+    /* the index is walked under the user's lock, as it is not RCU-safe */
+    if (mutex_lock_interruptible(&user->lock)) {
+        kfree(lo);
+        return -ERESTARTSYS;
+    }
+
+    /* walk the keys from the first one not less than lo, or than the key the
+     * last call stopped at; as stamps rise along a chain, the values that
+     * call stored are the ones of that key stamped below where it stopped */
+    h = resume ? ordered_seek(dev->data, uid, next, scan.next_len)
+               : ordered_seek(dev->data, uid, lo, scan.lo_len);
+    for (; h != NULL; h = ordered_next(h)) {
+        const char *key  = kv_key(h->first);
+        int         klen = h->first->kv.klen;
+
+        /* stop at the first key past the range */
+        if (prefix && (klen < scan.lo_len || memcmp(key, lo, scan.lo_len) != 0)) break;
+        if (bounded && kv_key_cmp(key, klen, hi, scan.hi_len) >= 0) break;
+
+        int same = resume && kv_key_cmp(key, klen, next, scan.next_len) == 0;
+        resume   = 0;
+
+        for (l = h->first; l != NULL; l = l->next) {
+            int vlen = l->kv.vlen;
+            int len  = klen + 1 + vlen + 1;
+
+            if (same && l->stamp < scan.stamp) continue;
+
+            if (len > room) {
+                /* leave where to pick up: this key and this value */
+                scan.flags |= KV_MOD_SCAN_MORE;
+                scan.stamp  = l->stamp;
+                if (scan.next) {
+                    scan.next_len = klen;
+                    if (copy_to_user((char __user *)(unsigned long) scan.next, key, klen))
+                        retval = -EFAULT;
+                }
+                goto out;
+            }
+
+            if (copy_to_user(out, key, klen) || put_user(' ', out + klen) ||
+                copy_to_user(out + klen + 1, kv_val(l), vlen) ||
+                put_user('\0', out + len - 1)) {
+                retval = -EFAULT;
+                goto out;
+            }
+
+            out  += len;
+            room -= len;
+            scan.count++;
+        }
+    }
+
+  out:
+    mutex_unlock(&user->lock);
+  done:
+    kfree(lo);
+
+    /* report how much was stored, even when the buffer filled */
+    scan.buf_len -= room;
+    if (retval == 0 && copy_to_user(uscan, &scan, sizeof(scan))) retval = -EFAULT;
+
+    return retval;
+}
+
+/*
+ * Lookup:  moves the file's cursor to the caller's pair and returns it in one
+ * call (see struct kv_mod_lookup), in place of KV_MOD_IOCSKEY and llseek.
+ */
+static long kv_mod_lookup(struct kv_mod_file *f,
+                          struct kv_mod_lookup __user *ulook) {
+    struct kv_mod_lookup look;
+    long                 retval = 0;
+
+    if (copy_from_user(&look, ulook, sizeof(look))) return -EFAULT;
+    if (look.klen > MAX_KEY_SIZE || look.vlen > MAX_VAL_SIZE) return -EINVAL;
+
+    /* the key and value are fetched into the front of the buffer, where the
+       pair found is then assembled over them */
+    char *kbuf = kmalloc(KV_PAIR_MAX, GFP_KERNEL);
+    if (kbuf == NULL) return -ENOMEM;
+
+    char *key = kbuf;
+    char *val = (look.val == 0) ? NULL : kbuf + look.klen + 1;
+
+    if (copy_from_user(key, (char __user *)(unsigned long) look.key, look.klen) ||
+        (val != NULL &&
+         copy_from_user(val, (char __user *)(unsigned long) look.val, look.vlen))) {
+        retval = -EFAULT;
+        goto out;
+    }
+
+    int len = cursor_seek(f, get_user_id(), key, look.klen, val, look.vlen,
+                          (look.buf == 0) ? NULL : kbuf);
+
+    /* the cursor has moved even if the pair does not fit in buf */
+    u32 stored = 0;
+    if (len > 0 && look.buf != 0) {
+        if (len > look.buf_len) {
+            retval = -EINVAL;
+            goto out;
+        }
+        if (copy_to_user((char __user *)(unsigned long) look.buf, kbuf, len)) {
+            retval = -EFAULT;
+            goto out;
+        }
+        stored = len;
+    }
+
+    if (put_user(stored, &ulook->buf_len)) retval = -EFAULT;
+    else if (len > 0)                            retval = 1;
+  out:
+    kfree(kbuf);
+    return retval;
+}
+
+/*
+ * The binary ioctls:  each takes its pair as a struct with explicit lengths
+ * (see struct kv_mod_pair), copying the key and value in once and the result
+ * out once, with nothing formatted or parsed.  They leave the cursor alone.
+ */
+
+/* fetch:  copies the len bytes at user pointer src into dst, of max bytes */
+static int fetch(char *dst, __u64 src, __u32 len, __u32 max) {
+    if (len > max) return -EINVAL;
+    if (copy_from_user(dst, (char __user *)(unsigned long) src, len)) return -EFAULT;
+    return 0;
+}
+
+/*
+ * vault_get:  stores the first value of uid's key in val, if it fits in room
+ *             bytes, and returns its length, or -ENOENT if there is no key
+ */
+static int vault_get(struct key_vault *v, uid_t uid, const char *key, int klen,
+                     char *val, int room) {
+    struct kv_list *l;
+    int             i;
+    int             vlen = -ENOENT;
+
+    rcu_read_lock();
+    l = find_key(v, uid, key, klen, &i);
+    if (l != NULL) {
+        vlen = l->kv.vlen;
+        if (vlen <= room) memcpy(val, kv_val(l), vlen);
+    }
+    rcu_read_unlock();
+
+    return vlen;
+}
+
+/*
+ * vault_del:  deletes uid's pair key val, returning 0, or -ENOENT if there is
+ *             no such pair; called with the user's lock
+ */
+static int vault_del(struct key_vault *v, uid_t uid, const char *key, int klen,
+                     const char *val, int vlen) {
+    if (find_key_val(v, uid, key, klen, val, vlen) == NULL) return -ENOENT;
+
+    delete_pair(v, uid, key, klen, val, vlen);
+    return 0;
+}
+
+/* Get:  returns the first value of the caller's key */
+static long kv_mod_get(struct kv_mod_dev *dev, struct kv_mod_pair __user *upair) {
+    struct kv_mod_pair pair;
+    long               retval;
+
+    if (copy_from_user(&pair, upair, sizeof(pair))) return -EFAULT;
+
+    char *key = kmalloc(MAX_KEY_SIZE + MAX_VAL_SIZE, GFP_KERNEL);
+    if (key == NULL) return -ENOMEM;
+    char *val = key + MAX_KEY_SIZE;
+
+    retval = fetch(key, pair.key, pair.klen, MAX_KEY_SIZE);
+    if (retval < 0) goto out;
+
+    int vlen = vault_get(dev->data, get_user_id(), key, pair.klen, val,
+                         min(pair.vlen, (__u32) MAX_VAL_SIZE));
+    if (vlen < 0) {
+        retval = vlen;
+        goto out;
+    }
+
+    /* the caller learns the length needed, whether or not the value fit */
+    if (put_user(vlen, &upair->vlen)) retval = -EFAULT;
+    else if (vlen > pair.vlen)        retval = -EOVERFLOW;
+    else if (copy_to_user((char __user *)(unsigned long) pair.val, val, vlen)) {
+        retval = -EFAULT;
+    }
+  out:
+    kfree(key);
+    return retval;
+}
+
+/* Put and Del:  insert or delete the caller's pair, under the user's lock */
+static long kv_mod_change(struct kv_mod_dev *dev,
+                          struct kv_mod_pair __user *upair, int del) {
+    struct kv_mod_pair pair;
+    struct kv_list_h  *user;
+    uid_t              uid = get_user_id();
+    long               retval;
+
+    if (copy_from_user(&pair, upair, sizeof(pair))) return -EFAULT;
+
+    char *key = kmalloc(MAX_KEY_SIZE + MAX_VAL_SIZE, GFP_KERNEL);
+    if (key == NULL) return -ENOMEM;
+    char *val = key + MAX_KEY_SIZE;
+
+    retval = fetch(key, pair.key, pair.klen, MAX_KEY_SIZE);
+    if (retval == 0) retval = fetch(val, pair.val, pair.vlen, MAX_VAL_SIZE);
+    if (retval < 0) goto out;
+
+    /* only an insert adds a user */
+    user = find_user(dev->data, uid, !del);
+    if (user == NULL) {
+        retval = del ? -ENOENT : -ENOMEM;
+        goto out;
+    }
+
+    if (mutex_lock_interruptible(&user->lock)) {
+        retval = -ERESTARTSYS;
+        goto out;
+    }
+
+    if (del) retval = vault_del(dev->data, uid, key, pair.klen, val, pair.vlen);
+    else     retval = insert_pair(dev->data, uid, key, pair.klen, val, pair.vlen);
+
+    mutex_unlock(&user->lock);
+
+    if (!del && retval == 0) quota_notice(dev->data, uid);
+  out:
+    kfree(key);
+    return retval;
+}
+
+/* Getall:  returns the values of the caller's key (see struct kv_mod_vals) */
+static long kv_mod_getall(struct kv_mod_dev *dev,
+                          struct kv_mod_vals __user *uvals) {
+    struct kv_mod_vals vals;
+    struct kv_head    *h;
+    struct kv_list    *l;
+    uid_t              uid = get_user_id();
+    long               retval;
+    int                i;
+
+    if (copy_from_user(&vals, uvals, sizeof(vals))) return -EFAULT;
+
+    /* the values are assembled under RCU, so at most a chunk at a time */
+    u32   room = min(vals.buf_len, (__u32) KV_MOD_STREAM_CHUNK);
+    u32   len  = 0;
+    char *key  = kmalloc(MAX_KEY_SIZE + room, GFP_KERNEL);
+    if (key == NULL) return -ENOMEM;
+    char *out  = key + MAX_KEY_SIZE;
+
+    retval = fetch(key, vals.key, vals.klen, MAX_KEY_SIZE);
+    if (retval < 0) goto out;
+
+    vals.count  = 0;
+    vals.flags &= ~KV_MOD_SCAN_MORE;
+
+    rcu_read_lock();
+    l = find_key(dev->data, uid, key, vals.klen, &i);
+    if (l == NULL) retval = -ENOENT;
+
+    /* the key's values are those up to the first pair of another chain */
+    for (h = (l == NULL) ? NULL : l->head;
+         l != NULL && l->head == h; l = next_key(dev->data, uid, l)) {
+        u32 vlen = l->kv.vlen;
+
+        /* stamps rise along the chain: those below were stored before */
+        if (l->stamp < vals.stamp) continue;
+
+        if (len + KV_MOD_REC_LEN(vlen) > room) {
+            vals.flags |= KV_MOD_SCAN_MORE;
+            vals.stamp  = l->stamp;
+            break;
+        }
+
+        *(u32 *)(out + len) = vlen;
+        memcpy(out + len + sizeof(u32), kv_val(l), vlen);
+        memset(out + len + sizeof(u32) + vlen, 0,
+               KV_MOD_REC_LEN(vlen) - sizeof(u32) - vlen);
+
+        len += KV_MOD_REC_LEN(vlen);
+        vals.count++;
+    }
+    rcu_read_unlock();
+
+    if (retval < 0) goto out;
+
+    vals.buf_len = len;
+    if (copy_to_user((char __user *)(unsigned long) vals.buf, out, len) ||
+        copy_to_user(uvals, &vals, sizeof(vals))) {
+        retval = -EFAULT;
+    }
+  out:
+    kfree(key);
+    return retval;
+}
+
+/*
+ * batch_run:  runs count operations (see struct kv_mod_op) on uid's pairs in
+ *             order, setting each one's result; returns 0, or -errno if none
+ *             could run.  Every key and value is copied in before the lock is
+ *             taken, and the values found are copied out after it is dropped.
+ *             In between, the keys' chains are first looked up under RCU and
+ *             prefetched, so the pass under the lock seldom waits on memory.
+ */
+static int batch_run(struct kv_mod_file *f, uid_t uid, struct kv_mod_op *ops,
+                     int count) {
+    struct key_vault   *v   = f->dev->data;
+    struct kv_list_h   *user;
+    struct kv_list     *l;
+    char              **kp;        /* each op's key, then value, in kbuf   */
+    char               *kbuf, *p;
+    size_t              size = 0;
+    int                 put  = FALSE;
+    int                 inserted = FALSE;
+    int                 i, j;
+
+    /* check each operation, and size the buffer for its key and value; a GET
+       needs room for no more than the longest value */
+    for (i = 0; i < count; i++) {
+        struct kv_mod_op *op = &ops[i];
+
+        if (op->op == KV_MOD_OP_GET) {
+            op->vlen = min(op->vlen, (__u32) MAX_VAL_SIZE);
+        } else if (op->op == KV_MOD_OP_LOOKUP && op->val == 0) {
+            op->vlen = 0;
+        }
+
+        op->result = 0;
+        if (op->op > KV_MOD_OP_LOOKUP || op->klen > MAX_KEY_SIZE ||
+            op->vlen > MAX_VAL_SIZE) {
+            op->result = -EINVAL;
+            continue;
+        }
+
+        if (op->op == KV_MOD_OP_PUT) put = TRUE;
+        size += op->klen + op->vlen;
+    }
+
+    kp = kmalloc(count * sizeof(char *) + size, GFP_KERNEL);
+    if (kp == NULL) return -ENOMEM;
+    kbuf = (char *) (kp + count);
+
+    /* fetch the keys and values; a bad pointer fails just its operation */
+    for (i = 0, p = kbuf; i < count; i++) {
+        struct kv_mod_op *op = &ops[i];
+
+        kp[i] = p;
+        if (op->result < 0) continue;
+        p += op->klen + op->vlen;
+
+        op->result = fetch(kp[i], op->key, op->klen, MAX_KEY_SIZE);
+        if (op->result == 0 && op->op != KV_MOD_OP_GET) {
+            op->result = fetch(kp[i] + op->klen, op->val, op->vlen, MAX_VAL_SIZE);
+        }
+    }
+
+    /* warm the chains the operations will touch */
+    rcu_read_lock();
+    for (i = 0; i < count; i++) {
+        if (ops[i].result < 0) continue;
+
+        l = find_key(v, uid, kp[i], ops[i].klen, &j);
+        if (l != NULL) {
+            prefetch(l);
+            prefetch(kv_val(l));
+        }
+    }
+    rcu_read_unlock();
+
+    /* only a PUT adds a user; with no user, there is nothing to find */
+    user = find_user(v, uid, put);
+    if (user == NULL) {
+        for (i = 0; i < count; i++) {
+            if (ops[i].result == 0) ops[i].result = put ? -ENOMEM : -ENOENT;
+        }
+        goto out;
+    }
+
+    if (mutex_lock_interruptible(&user->lock)) {
+        kfree(kp);
+        return -ERESTARTSYS;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct kv_mod_op *op  = &ops[i];
+        char             *key = kp[i];
+        char             *val = kp[i] + op->klen;
+        int               n;
+
+        if (op->result < 0) continue;
+
+        switch (op->op) {
+          case KV_MOD_OP_GET:
+              n = vault_get(v, uid, key, op->klen, val, op->vlen);
+              if (n > (int) op->vlen) op->result = -EOVERFLOW;
+              if (n < 0)              op->result = n;
+              op->vlen = max(n, 0);
+              break;
+          case KV_MOD_OP_PUT:
+              op->result = insert_pair(v, uid, key, op->klen, val, op->vlen);
+              if (op->result == 0) inserted = TRUE;
+              break;
+          case KV_MOD_OP_DEL:
+              op->result = vault_del(v, uid, key, op->klen, val, op->vlen);
+              break;
+          case KV_MOD_OP_LOOKUP:
+              n = cursor_seek(f, uid, key, op->klen,
+                              (op->val == 0) ? NULL : val, op->vlen, NULL);
+              op->result = (n > 0) ? 0 : -ENOENT;
+              break;
+        }
+    }
+
+    mutex_unlock(&user->lock);
+
+    if (inserted) quota_notice(v, uid);
+
+  out:
+    /* hand back the values found */
+    for (i = 0; i < count; i++) {
+        if (ops[i].op != KV_MOD_OP_GET || ops[i].result < 0) continue;
+
+        if (copy_to_user((char __user *)(unsigned long) ops[i].val,
+                         kp[i] + ops[i].klen, ops[i].vlen)) {
+            ops[i].result = -EFAULT;
+        }
+    }
+
+    kfree(kp);
+    return 0;
+}
+
+/* Batch:  runs the caller's operations (see struct kv_mod_batch) */
+static long kv_mod_batch(struct kv_mod_file *f,
+                         struct kv_mod_batch __user *ubatch) {
+    struct kv_mod_batch batch;
+    struct kv_mod_op   *ops;
+    long                retval;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch))) return -EFAULT;
+    if (batch.count == 0) return 0;
+    if (batch.count > KV_MOD_BATCH_MAX) return -EINVAL;
+
+    ops = kmalloc(batch.count * sizeof(struct kv_mod_op), GFP_KERNEL);
+    if (ops == NULL) return -ENOMEM;
+
+    if (copy_from_user(ops, (void __user *)(unsigned long) batch.ops,
+                       batch.count * sizeof(struct kv_mod_op))) {
+        retval = -EFAULT;
+        goto out;
+    }
+
+    /* every result goes back in one copy */
+    retval = batch_run(f, get_user_id(), ops, batch.count);
+    if (retval == 0 &&
+        copy_to_user((void __user *)(unsigned long) batch.ops, ops,
+                     batch.count * sizeof(struct kv_mod_op))) {
+        retval = -EFAULT;
+    }
+  out:
+    kfree(ops);
+    return retval;
+}
+
+/*
+ * Ring:  gives the file submission and completion rings of entries slots each
+ * (see struct kv_mod_ring), returning the bytes for mmap() to map.  A file
+ * has its rings until it is closed.  As with io_uring, the rings are bound to
+ * the caller: its address space is the one the submissions' pointers are
+ * read in, and its uid the one whose pairs they reach, whoever rings the
+ * doorbell.
+ */
+static long kv_mod_ring_setup(struct kv_mod_file *f, unsigned long entries) {
+    struct kv_mod_ring *ring;
+    size_t              sq_off = sizeof(struct kv_mod_ring);
+    size_t              cq_off = sq_off + entries * sizeof(struct kv_mod_sqe);
+    size_t              size;
+
+    if (entries == 0 || entries > KV_MOD_RING_MAX || (entries & (entries - 1))) {
+        return -EINVAL;
+    }
+    size = PAGE_ALIGN(cq_off + entries * sizeof(struct kv_mod_cqe));
+
+    /* zeroed, so both rings start empty */
+    ring = vmalloc_user(size);
+    if (ring == NULL) return -ENOMEM;
+
+    ring->entries = entries;
+    ring->sq_off  = sq_off;
+    ring->cq_off  = cq_off;
+
+    mutex_lock(&f->ring_lock);
+    if (f->ring != NULL) {
+        mutex_unlock(&f->ring_lock);
+        vfree(ring);
+        return -EBUSY;
+    }
+
+    /* the mm is only compared against, so a count on the struct suffices
+       to keep it from being reused for another process's */
+    atomic_inc(&current->mm->mm_count);
+    f->ring_mm   = current->mm;
+    f->ring_uid  = get_user_id();
+    f->ring_size = size;
+    f->entries   = entries;
+    f->sq_head   = 0;
+    f->cq_tail   = 0;
+    /* poll() finds the ring without the lock */
+    smp_store_release(&f->ring, ring);
+    mutex_unlock(&f->ring_lock);
+
+    return size;
+}
+
+/*
+ * Submit:  the rings' doorbell, which runs up to max of the operations posted
+ * to the file's submission ring (all of them, if max is 0) as the creator's,
+ * a batch at a time, and posts their completions, waking any poller; returns
+ * how many were run.  Only the creator's address space may ring it.
+ */
+static long kv_mod_submit(struct kv_mod_file *f, unsigned long max) {
+    struct kv_mod_ring *ring;
+    struct kv_mod_sqe  *sq;
+    struct kv_mod_cqe  *cq;
+    struct kv_mod_op   *ops;
+    u64                *tags;
+    u32                 mask, avail, room, n, m, i;
+    long                done = 0;
+    int                 rc   = 0;
+
+    if (mutex_lock_interruptible(&f->ring_lock)) return -ERESTARTSYS;
+
+    ring = f->ring;
+    if (ring == NULL) {
+        rc = -ENXIO;
+        goto unlock;
+    }
+    if (current->mm != f->ring_mm) {
+        rc = -EPERM;
+        goto unlock;
+    }
+
+    /* the slots are found from the kernel's copy of the size, not from the
+       offsets in the ring, which user space could change */
+    sq   = (struct kv_mod_sqe *) ((char *) ring + sizeof(struct kv_mod_ring));
+    cq   = (struct kv_mod_cqe *) (sq + f->entries);
+    mask = f->entries - 1;
+
+    /* what has been posted, and the room there is to complete it */
+    avail = smp_load_acquire(&ring->sq_tail) - f->sq_head;
+    room  = f->entries - (f->cq_tail - READ_ONCE(ring->cq_head));
+    if (avail > f->entries || room > f->entries) {
+        rc = -EINVAL;
+        goto unlock;
+    }
+
+    n = min(avail, room);
+    if (max != 0 && max < n) n = max;
+
+    ops = kmalloc(KV_MOD_BATCH_MAX * (sizeof(struct kv_mod_op) + sizeof(u64)),
+                  GFP_KERNEL);
+    if (ops == NULL) {
+        rc = -ENOMEM;
+        goto unlock;
+    }
+    tags = (u64 *) (ops + KV_MOD_BATCH_MAX);
+
+    while (done < n) {
+        m = min(n - (u32) done, (u32) KV_MOD_BATCH_MAX);
+
+        /* each submission is copied out of the ring once, so that user space
+           changing it afterwards cannot change the operation under way */
+        for (i = 0; i < m; i++) {
+            struct kv_mod_sqe sqe;
+
+            memcpy(&sqe, &sq[(f->sq_head + i) & mask], sizeof(sqe));
+            tags[i]     = sqe.tag;
+            ops[i].key  = sqe.key;
+            ops[i].val  = sqe.val;
+            ops[i].klen = sqe.klen;
+            ops[i].vlen = sqe.vlen;
+            ops[i].op   = sqe.op;
+        }
+
+        rc = batch_run(f, f->ring_uid, ops, m);
+        if (rc < 0) break;
+
+        for (i = 0; i < m; i++) {
+            struct kv_mod_cqe *cqe = &cq[(f->cq_tail + i) & mask];
+
+            cqe->tag    = tags[i];
+            cqe->result = ops[i].result;
+            cqe->vlen   = ops[i].vlen;
+        }
+        f->sq_head += m;
+
+        /* the completions are visible before their tail moves, in the ring
+           and in the kernel's copy, which poll() reads without the lock */
+        smp_store_release(&f->cq_tail, f->cq_tail + m);
+        smp_store_release(&ring->cq_tail, f->cq_tail);
+        smp_store_release(&ring->sq_head, f->sq_head);
+        done += m;
+    }
+
+    kfree(ops);
+    if (done > 0) wake_up_interruptible(&f->ring_wait);
+  unlock:
+    mutex_unlock(&f->ring_lock);
+
+    /* what was run is reported before any error met after it */
+    return (done > 0) ? done : rc;
+}
+
+/*
+ * The answer to KV_MOD_IOCTKICK, run by a kernel worker.  The worker borrows
+ * the ring's address space to reach the keys and values the submissions
+ * point to.
+ */
+static void kv_mod_kick_work(struct work_struct *work) {
+    struct kv_mod_file *f    = container_of(work, struct kv_mod_file, kick);
+    struct file        *filp = f->kick_filp;
+    struct mm_struct   *mm   = f->kick_mm;
+    mm_segment_t        oldfs;
+
+    /* a kick from here on queues the work again, with references of its
+       own, so that nothing posted while the ring drains is missed */
+    clear_bit_unlock(KV_MOD_KICKED, &f->kicked);
+
+    /* a kernel thread runs with KERNEL_DS, under which access_ok() would
+       pass the kernel addresses a submission might carry; the caller's
+       pointers must be checked as they would be in the caller */
+    oldfs = get_fs();
+    set_fs(USER_DS);
+    use_mm(mm);
+    kv_mod_submit(f, 0);
+    unuse_mm(mm);
+    set_fs(oldfs);
+
+    mmput(mm);
+    fput(filp);
+}
+
+/*
+ * Kick:  rings the doorbell without waiting for it to be answered; the
+ * operations posted are run by a kernel worker, whose completions wake poll().
+ * Kicks made while the worker is queued are answered by it, so only the kick
+ * that queues it pins the file and the ring's address space.  Only that
+ * address space may kick, so that no other can have the ring run in it.
+ */
+static long kv_mod_kick(struct file *filp) {
+    struct kv_mod_file *f = filp->private_data;
+    struct mm_struct   *mm;
+
+    /* ring_mm is set before the ring is published */
+    if (smp_load_acquire(&f->ring) == NULL) return -ENXIO;
+    if (current->mm != f->ring_mm) return -EPERM;
+
+    if (test_and_set_bit_lock(KV_MOD_KICKED, &f->kicked)) return 0;
+
+    mm = get_task_mm(current);
+    if (mm == NULL) {
+        clear_bit_unlock(KV_MOD_KICKED, &f->kicked);
+        return -EINVAL;
+    }
+
+    f->kick_mm   = mm;
+    f->kick_filp = get_file(filp);
+    queue_work(system_wq, &f->kick);
+
+    return 0;
+}
+
+/*
+ * Poll:  reads and writes never wait, so a file is always ready for them;
+ * once it has rings, it is readable only while completions wait to be
+ * consumed, so that an event loop can wait on the rings.  It takes no lock,
+ * so as not to wait behind a doorbell that is draining the ring.
+ */
+unsigned int kv_mod_poll(struct file *filp, poll_table *wait) {
+    struct kv_mod_file *f = filp->private_data;
+    struct kv_mod_ring *ring;
+    unsigned int        mask = POLLOUT | POLLWRNORM;
+
+    poll_wait(filp, &f->ring_wait, wait);
+
+    ring = READ_ONCE(f->ring);
+    if (ring == NULL ||
+        READ_ONCE(ring->cq_head) != smp_load_acquire(&f->cq_tail)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    return mask;
+}
+
+/*
+ * Mmap:  maps the rings set up by KV_MOD_IOCTRING, from their start
+ */
+int kv_mod_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct kv_mod_file *f      = filp->private_data;
+    int                 retval = -EINVAL;
+
+    mutex_lock(&f->ring_lock);
+    if (f->ring != NULL && vma->vm_pgoff == 0 &&
+        vma->vm_end - vma->vm_start <= f->ring_size) {
+        retval = remap_vmalloc_range(vma, f->ring, 0);
+    }
+    mutex_unlock(&f->ring_lock);
+
+    return retval;
+}
 
 long kv_mod_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
    	int err    = 0;
@@ -282,10 +1611,61 @@ long kv_mod_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 	/* exit on error */
 	if (err) return -EFAULT;
 	
+    struct kv_mod_file  *f   = filp->private_data;
+    struct kv_mod_dev   *dev = f->dev;
+    struct kv_mod_stats  stats;
+
     /* parse the incoming command */
 	switch(cmd) {
       case KV_MOD_IOCSKEY:
-		  retval = copy_from_user(seek_key, (char*) arg, strnlen((char*) arg, 79)+1);
+		  /* the target is the file's own, for the llseek that follows */
+		  if (strncpy_from_user(f->seek, (char __user *) arg,
+		                        sizeof(f->seek) - 1) < 0) {
+			  retval = -EFAULT;
+		  }
+		  f->seek[sizeof(f->seek) - 1] = '\0';
+          break;
+      case KV_MOD_IOCGSTATS:
+          /* the totals are per-CPU counters, so no lock is needed */
+          stats.keys  = num_vkeys(dev->data);
+          stats.pairs = num_vpairs(dev->data);
+          if (copy_to_user((void __user *) arg, &stats, sizeof(stats))) {
+              retval = -EFAULT;
+          }
+          break;
+      case KV_MOD_IOCXSCAN:
+          retval = kv_mod_scan(dev, (struct kv_mod_scan __user *) arg);
+          break;
+      case KV_MOD_IOCXLOOKUP:
+          retval = kv_mod_lookup(f, (struct kv_mod_lookup __user *) arg);
+          break;
+      case KV_MOD_IOCTMODE:
+          if (arg & ~KV_MOD_STREAM) return -EINVAL;
+          f->mode = arg;
+          break;
+      case KV_MOD_IOCXGET:
+          retval = kv_mod_get(dev, (struct kv_mod_pair __user *) arg);
+          break;
+      case KV_MOD_IOCSPUT:
+          retval = kv_mod_change(dev, (struct kv_mod_pair __user *) arg, FALSE);
+          break;
+      case KV_MOD_IOCSDEL:
+          retval = kv_mod_change(dev, (struct kv_mod_pair __user *) arg, TRUE);
+          break;
+      case KV_MOD_IOCXGETALL:
+          retval = kv_mod_getall(dev, (struct kv_mod_vals __user *) arg);
+          break;
+      case KV_MOD_IOCXBATCH:
+          retval = kv_mod_batch(f, (struct kv_mod_batch __user *) arg);
+          break;
+      case KV_MOD_IOCTRING:
+          retval = kv_mod_ring_setup(f, arg);
+          break;
+      case KV_MOD_IOCTSUBMIT:
+          retval = kv_mod_submit(f, arg);
+          break;
+      case KV_MOD_IOCTKICK:
+          retval = kv_mod_kick(filp);
           break;
       default:
           return -ENOTTY;
@@ -298,20 +1678,175 @@ long kv_mod_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
  * Seek:  the only one of the "extended" operations which kv_mod implements.
  */
 loff_t kv_mod_llseek(struct file *filp, loff_t off, int whence) {
-    struct kv_mod_dev *dev    = filp->private_data; 
-    int uid = get_user_id();
-    /* get seek_key data using sscanf */
-    char key[MAX_KEY_SIZE];
-    char val[MAX_VAL_SIZE];
-    sscanf(seek_key, "%s %s", key, val);
+    struct kv_mod_file *f  = filp->private_data;
+    /* split the file's seek target into its key and value */
+    char *pos = f->seek;
+    char *end = f->seek + strlen(f->seek);
+    int   klen, vlen;
+    char *key = next_token(&pos, end, &klen);
+    char *val = next_token(&pos, end, &vlen);
+
+    if (val == NULL) return 0;
 
     /* find the key-value pair; return 0 on failure and 1 on success */
-    dev->data->ukey_data[uid-1].fp = find_key_val(dev->data, uid, key, val);
-    if (dev->data->ukey_data[uid-1].fp == NULL) {
-        return 0;
-    } else return 1;
+    return cursor_seek(f, get_user_id(), key, klen, val, vlen, NULL) > 0;
 }
 
+/*
+ * Sysfs attributes: /sys/class/kv_mod/kv_modN/{keys,pairs} report the same
+ * vault-wide totals as KV_MOD_IOCGSTATS, for cheap polling by monitors, and
+ * bytes the kernel memory held for all users.
+ */
+static ssize_t keys_show(struct device *d, struct device_attribute *attr,
+                         char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%lld\n", (long long) num_vkeys(dev->data));
+}
+static DEVICE_ATTR_RO(keys);
+
+static ssize_t pairs_show(struct device *d, struct device_attribute *attr,
+                          char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%lld\n", (long long) num_vpairs(dev->data));
+}
+static DEVICE_ATTR_RO(pairs);
+
+static ssize_t bytes_show(struct device *d, struct device_attribute *attr,
+                          char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%lld\n", (long long) num_vbytes(dev->data));
+}
+static DEVICE_ATTR_RO(bytes);
+
+/*
+ * arena_{allocs,frees,chunks} total the users' arenas: the objects handed out
+ * and taken back since the device was loaded, and the slab chunks now held.
+ * Like usage below, they walk the vault under RCU.
+ */
+static unsigned long arena_sum(struct key_vault *v, size_t field) {
+    struct kv_list_h *batch[KV_UID_BATCH];
+    unsigned long     from = 0;
+    unsigned long     sum  = 0;
+    int               found, u;
+
+    rcu_read_lock();
+    while ((found = radix_tree_gang_lookup(&v->users, (void **) batch,
+                                           from, KV_UID_BATCH)) > 0) {
+        for (u = 0; u < found; u++) {
+            sum += READ_ONCE(*(unsigned long *) ((char *) &batch[u]->arena +
+                                                 field));
+        }
+        from = (unsigned long) batch[found-1]->uid + 1;
+    }
+    rcu_read_unlock();
+
+    return sum;
+}
+
+static ssize_t arena_allocs_show(struct device *d,
+                                 struct device_attribute *attr, char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%lu\n",
+                   arena_sum(dev->data, offsetof(struct kv_arena, allocs)));
+}
+static DEVICE_ATTR_RO(arena_allocs);
+
+static ssize_t arena_frees_show(struct device *d,
+                                struct device_attribute *attr, char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%lu\n",
+                   arena_sum(dev->data, offsetof(struct kv_arena, frees)));
+}
+static DEVICE_ATTR_RO(arena_frees);
+
+static ssize_t arena_chunks_show(struct device *d,
+                                 struct device_attribute *attr, char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%lu\n",
+                   arena_sum(dev->data, offsetof(struct kv_arena, nchunks)));
+}
+static DEVICE_ATTR_RO(arena_chunks);
+
+/*
+ * usage lists "uid bytes" for every user of the device, in uid order, as far
+ * as a page allows; unlike the totals above it walks the vault, under RCU, so
+ * that no user's updates are held up.
+ */
+static ssize_t usage_show(struct device *d, struct device_attribute *attr,
+                          char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    struct kv_list_h  *batch[KV_UID_BATCH];
+    unsigned long      from = 0;
+    ssize_t            len  = 0;
+    int                found, u;
+
+    rcu_read_lock();
+    while ((found = radix_tree_gang_lookup(&dev->data->users, (void **) batch,
+                                           from, KV_UID_BATCH)) > 0) {
+        for (u = 0; u < found; u++) {
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%u %ld\n",
+                             batch[u]->uid,
+                             num_bytes(dev->data, batch[u]->uid));
+        }
+        from = (unsigned long) batch[found-1]->uid + 1;
+    }
+
+    rcu_read_unlock();
+    return len;
+}
+static DEVICE_ATTR_RO(usage);
+
+/* the quotas may be changed at any time; they bind from the next insert */
+static ssize_t quota_store(size_t *quota, const char *buf, size_t count) {
+    unsigned long bytes;
+    int           rc = kstrtoul(buf, 0, &bytes);
+
+    if (rc) return rc;
+
+    *quota = bytes;
+    return count;
+}
+
+static ssize_t soft_quota_show(struct device *d, struct device_attribute *attr,
+                               char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%zu\n", dev->data->soft_quota);
+}
+
+static ssize_t soft_quota_store(struct device *d, struct device_attribute *attr,
+                                const char *buf, size_t count) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return quota_store(&dev->data->soft_quota, buf, count);
+}
+static DEVICE_ATTR_RW(soft_quota);
+
+static ssize_t hard_quota_show(struct device *d, struct device_attribute *attr,
+                               char *buf) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return sprintf(buf, "%zu\n", dev->data->hard_quota);
+}
+
+static ssize_t hard_quota_store(struct device *d, struct device_attribute *attr,
+                                const char *buf, size_t count) {
+    struct kv_mod_dev *dev = dev_get_drvdata(d);
+    return quota_store(&dev->data->hard_quota, buf, count);
+}
+static DEVICE_ATTR_RW(hard_quota);
+
+static struct attribute *kv_mod_attrs[] = {
+    &dev_attr_keys.attr,
+    &dev_attr_pairs.attr,
+    &dev_attr_bytes.attr,
+    &dev_attr_usage.attr,
+    &dev_attr_arena_allocs.attr,
+    &dev_attr_arena_frees.attr,
+    &dev_attr_arena_chunks.attr,
+    &dev_attr_soft_quota.attr,
+    &dev_attr_hard_quota.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(kv_mod);
+
 /* this assignment is what "binds" the template file operations with those that
  * are implemented herein.
  */
@@ -320,11 +1855,25 @@ struct file_operations kv_mod_fops = {
 	.llseek =   kv_mod_llseek,
 	.read =     kv_mod_read,
 	.write =    kv_mod_write,
+	.read_iter =  kv_mod_read_iter,
+	.write_iter = kv_mod_write_iter,
 	.unlocked_ioctl = kv_mod_ioctl,
+	.mmap =     kv_mod_mmap,
+	.poll =     kv_mod_poll,
 	.open =     kv_mod_open,
 	.release =  kv_mod_release,
 };
 
+/* the KV_VAULT_* options given for device i by the per-device parameters */
+static int kv_mod_vault_flags(int i) {
+    int flags = 0;
+
+    if (kv_mod_set_mode[i]) flags |= KV_VAULT_SET;
+    if (kv_mod_ordered[i])  flags |= KV_VAULT_ORDERED;
+
+    return flags;
+}
+
 /*
  * The cleanup function is used to handle initialization failures as well.
  * Thefore, it must be careful to work correctly even if some of the items
@@ -342,6 +1891,12 @@ void kv_mod_cleanup_module(void) {
        * deleting them from the kernel */
 	   int i;
 		for (i = 0; i < kv_mod_nr_devs; i++) {
+			/* devices past an initialization failure were never set up */
+			if (kv_mod_devices[i].data == NULL) continue;
+
+			if (kv_mod_devices[i].device != NULL) {
+				device_destroy(kv_mod_class, kv_mod_devices[i].cdev.dev);
+			}
 			remove_data(kv_mod_devices + i);
 			cdev_del(&kv_mod_devices[i].cdev);
 		}
@@ -351,6 +1906,12 @@ void kv_mod_cleanup_module(void) {
 	}
 
     unregister_chrdev_region(devno, kv_mod_nr_devs);
+
+	/* the devices are gone, so their sysfs class can go too */
+	if (kv_mod_class != NULL) class_destroy(kv_mod_class);
+
+	/* every vault is closed, so the arenas' chunk cache can go */
+	kv_arena_close_cache();
 }
 
 
@@ -368,12 +1929,34 @@ static void kv_mod_setup_cdev(struct kv_mod_dev *dev, int index) {
 
   /* Fail gracefully if need be */
   if (err) printk(KERN_NOTICE "Error %d adding kv_mod%d", err, index);
+
+  /* publish the device's statistics in sysfs; the device still works without */
+  dev->device = device_create_with_groups(kv_mod_class, NULL, devno, dev,
+                                          kv_mod_groups, "kv_mod%d", index);
+  if (IS_ERR(dev->device)) {
+    printk(KERN_NOTICE "Error %ld adding kv_mod%d to sysfs",
+           PTR_ERR(dev->device), index);
+    dev->device = NULL;
+  }
 }
 
 int kv_mod_init_module(void) {
     int result, i;
     dev_t dev = 0;
 
+    /* user space sizes its buffers by the limits kv_mod_ioctl.h gives it */
+    BUILD_BUG_ON(KV_MOD_KEY_MAX != MAX_KEY_SIZE || KV_MOD_VAL_MAX != MAX_VAL_SIZE);
+
+    /* the per-device parameter arrays hold KV_MOD_MAX_DEVS entries */
+    if (kv_mod_nr_devs < 1 || kv_mod_nr_devs > KV_MOD_MAX_DEVS) {
+        printk(KERN_WARNING "kv_mod: kv_mod_nr_devs must be 1 to %d\n",
+               KV_MOD_MAX_DEVS);
+        return -EINVAL;
+    }
+
+    /* create the slab cache from which the vaults' arenas draw chunks */
+    if (!kv_arena_init_cache()) return -ENOMEM;
+
     /*
     * Compile-time default for major is zero (dynamically assigned) unless 
     * directed otherwise at load time.  Also get range of minors to work with.
@@ -387,8 +1970,12 @@ int kv_mod_init_module(void) {
 		result = register_chrdev_region(dev, kv_mod_nr_devs, "kv_mod");
 	}
 
+	/* every user must be allowed at least one key */
+	if (kv_mod_max_keys < 1) kv_mod_max_keys = 1;
+
 	/* report failue to aquire major number */
 	if (result < 0) {
+		kv_arena_close_cache();
 		return result;
 	}
 
@@ -407,14 +1994,32 @@ int kv_mod_init_module(void) {
 
 	/* otherwise, zero the memory */
 	memset(kv_mod_devices, 0, kv_mod_nr_devs * sizeof(struct kv_mod_dev));
+
+	/* create the class under which the devices appear in sysfs */
+	kv_mod_class = class_create(THIS_MODULE, "kv_mod");
+	if (IS_ERR(kv_mod_class)) {
+		result       = PTR_ERR(kv_mod_class);
+		kv_mod_class = NULL;
+		kv_mod_cleanup_module();
+		return result;
+	}
+
    /* Initialize each device. */
 	for (i = 0; i < kv_mod_nr_devs; i++) {
         /* Need to alloc the data field so there is something for init_vault to init */
-        kv_mod_devices[i].data = kmalloc(sizeof(struct key_vault), GFP_KERNEL); 
-        memset(kv_mod_devices[i].data, 0, sizeof(struct key_vault));
-        init_vault(kv_mod_devices[i].data, MAX_KEY_USER);
+        kv_mod_devices[i].data = kzalloc(sizeof(struct key_vault), GFP_KERNEL);
+        if (kv_mod_devices[i].data == NULL ||
+            !init_vault(kv_mod_devices[i].data, kv_mod_max_keys,
+                        kv_mod_vault_flags(i))) {
+            kfree(kv_mod_devices[i].data);
+            kv_mod_devices[i].data = NULL;
+            kv_mod_cleanup_module();
+            return -ENOMEM;
+        }
+        kv_mod_devices[i].mode = kv_mod_stream[i] ? KV_MOD_STREAM : 0;
+        kv_mod_devices[i].data->soft_quota = kv_mod_soft_quota;
+        kv_mod_devices[i].data->hard_quota = kv_mod_hard_quota;
 
-		sema_init(&kv_mod_devices[i].sem, 1);
 		kv_mod_setup_cdev(&kv_mod_devices[i], i);
 	}
 
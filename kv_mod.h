@@ -21,7 +21,7 @@
 #define _KV_MOD_H_
 
 #include "key_vault.h" /* key vault data structure */
-#include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include "kv_mod_ioctl.h" /* what user space shares with the module */
 
 /*
  * Macros to help debugging
@@ -50,12 +50,64 @@
 #define KV_MOD_NR_DEVS 1    /* kv_mod0 through kv_mod3 */
 #endif
 
+#ifndef KV_MOD_MAX_DEVS
+#define KV_MOD_MAX_DEVS 16  /* most devices kv_mod_nr_devs may ask for */
+#endif
+
+#ifndef KV_MOD_MAX_KEYS
+#define KV_MOD_MAX_KEYS 65536  /* unique keys per user, by default */
+#endif
+
+#ifndef KV_MOD_STREAM_CHUNK
+#define KV_MOD_STREAM_CHUNK 16384  /* bytes a stream read assembles at once */
+#endif
+
 struct kv_mod_dev {
 	struct key_vault   *data;      /* Pointer to first key vault     */
-	struct semaphore    sem;       /* mutual exclusion semaphore       */
 	struct cdev         cdev;	    /* Char device structure	   	    */
+	struct device      *device;    /* sysfs node for the statistics   */
+	int                 mode;      /* KV_MOD_STREAM: what files start in */
+};
+
+/*
+ * What each open file keeps in its private_data: a cursor of its own into the
+ * caller's pairs, so files (and the threads using them) iterate independently.
+ * Pairs may be deleted through other files at any time, so pos is trusted only
+ * while the user's delete generation still equals gen; otherwise the pair is
+ * looked up again from the copy of its key and value kept in pair, and its
+ * stamps tell where to resume if it is gone.
+ */
+struct kv_mod_file {
+	struct kv_mod_dev  *dev;
+	int                 mode;      /* KV_MOD_STREAM, or 0              */
+	spinlock_t          lock;      /* guards the cursor below          */
+	uid_t               uid;       /* whose pairs the cursor walks     */
+	struct kv_list     *pos;       /* pair at the cursor; NULL at end  */
+	unsigned long       gen;       /* user's gen when pos was set      */
+	u64                 hstamp;    /* stamps of pos's key and of pos   */
+	u64                 stamp;
+	int                 klen;      /* the key, then the value, of pos  */
+	int                 vlen;
+	char                pair[MAX_KEY_SIZE + MAX_VAL_SIZE];
+	char                seek[KV_PAIR_MAX]; /* "key val" set by IOCSKEY */
+	struct mutex        ring_lock; /* held by the ring's doorbell      */
+	wait_queue_head_t   ring_wait; /* pollers waiting on completions   */
+	struct kv_mod_ring *ring;      /* shared with user space, or NULL  */
+	size_t              ring_size; /* bytes mapped at ring             */
+	struct mm_struct   *ring_mm;   /* the address space and uid of the */
+	uid_t               ring_uid;  /* ring's creator, the only ones it
+	                                  serves                           */
+	u32                 entries;   /* the kernel's own copies of the   */
+	u32                 sq_head;   /* ring's size and its indexes,     */
+	u32                 cq_tail;   /* which user space may scribble on */
+	struct work_struct  kick;      /* answers KV_MOD_IOCTKICK          */
+	unsigned long       kicked;    /* KV_MOD_KICKED while kick queued  */
+	struct file        *kick_filp; /* held while kick is queued, with  */
+	struct mm_struct   *kick_mm;   /* ring_mm, kept in use for it      */
 };
 
+#define KV_MOD_KICKED 0   /* bit of kicked */
+
 /*
  * Split minors in two parts
  */
@@ -67,6 +119,12 @@ struct kv_mod_dev {
  */
 extern int kv_mod_major;
 extern int kv_mod_nr_devs;
+extern int kv_mod_max_keys;
+extern int kv_mod_set_mode[KV_MOD_MAX_DEVS];
+extern int kv_mod_ordered[KV_MOD_MAX_DEVS];
+extern int kv_mod_stream[KV_MOD_MAX_DEVS];
+extern unsigned long kv_mod_soft_quota;
+extern unsigned long kv_mod_hard_quota;
 
 /*
  * Prototypes for shared functions
@@ -76,27 +134,12 @@ ssize_t kv_mod_read  (struct file *filp, char __user *buf, size_t count,
                      loff_t *f_pos);
 ssize_t kv_mod_write (struct file *filp, const char __user *buf, size_t count,
                      loff_t *f_pos);
+ssize_t kv_mod_read_iter (struct kiocb *iocb, struct iov_iter *to);
+ssize_t kv_mod_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t  kv_mod_llseek(struct file *filp, loff_t off, int whence);
 long    kv_mod_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+int     kv_mod_mmap  (struct file *filp, struct vm_area_struct *vma);
+unsigned int kv_mod_poll(struct file *filp, poll_table *wait);
 
 
-/*
- * Ioctl definitions
- */
-
-/* Use 'r' as magic number */
-#define KV_MOD_IOC_MAGIC  'r'
-#define KV_MOD_IOCRESET    _IO(KV_MOD_IOC_MAGIC,     0)
-
-/*
- * S means "Set"       through a ptr,
- * T means "Tell"      directly with the argument value
- * G means "Get":      reply by setting through a pointer
- * Q means "Query":    response is on the return value
- * X means "eXchange": switch G and S atomically
- * H means "sHift":    switch T and Q atomically
- */
-#define KV_MOD_IOCSKEY _IOW (KV_MOD_IOC_MAGIC,   1, char)
-#define KV_MOD_IOC_MAXNR 1
-
 #endif /* _KV_MOD_H_ */
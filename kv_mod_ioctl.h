@@ -0,0 +1,231 @@
+/*
+ * kv_mod_ioctl.h -- what user space shares with the kv_mod module: the
+ * ioctl numbers and the structures they exchange, the file modes and the
+ * submission rings.  It needs only the kernel's exported headers, so that
+ * programs using the device may include it as well as the module.
+ *
+ * Modified by Rich Lively and Tim Froeberg 11/19/16
+ */
+
+#ifndef _KV_MOD_IOCTL_H_
+#define _KV_MOD_IOCTL_H_
+
+#include <linux/types.h> /* for __u32 and __u64 */
+#include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+
+/* longest key and value, in bytes; the vault's MAX_KEY_SIZE and MAX_VAL_SIZE */
+#define KV_MOD_KEY_MAX 256
+#define KV_MOD_VAL_MAX 1024
+
+#ifndef KV_MOD_BATCH_MAX
+#define KV_MOD_BATCH_MAX 64  /* most operations one KV_MOD_IOCXBATCH runs */
+#endif
+
+#ifndef KV_MOD_RING_MAX
+#define KV_MOD_RING_MAX 4096  /* most slots in a submission ring */
+#endif
+
+/*
+ * How a file reads and writes (see KV_MOD_IOCTMODE).  By default each read()
+ * returns one "key val\0" pair and each write() takes one, and both return 1.
+ * In stream mode a read() packs as many "key val\n" lines as fit in the
+ * buffer, and a write() applies every line of the buffer, a line "- key val"
+ * deleting that pair; both return bytes, so that cat and other plain readers
+ * and writers can drain and load a vault.
+ */
+#define KV_MOD_STREAM  0x1
+
+/*
+ * Vault-wide totals, as returned by KV_MOD_IOCGSTATS
+ */
+struct kv_mod_stats {
+	__u64 keys;     /* unique keys, summed over all users */
+	__u64 pairs;    /* key-value pairs, summed over all users */
+};
+
+/*
+ * A range or prefix scan, as exchanged with KV_MOD_IOCXSCAN.  The pairs whose
+ * keys fall in [lo, hi) -- or, with KV_MOD_SCAN_PREFIX, begin with lo -- are
+ * stored in key order as "key val\0" records, the same as read() returns.
+ * When buf fills, KV_MOD_SCAN_MORE is set and the place to resume is left in
+ * next, next_len and stamp: the key, and the stamp of its first value not yet
+ * stored.  Calling again with them as they were left picks up there, however
+ * many pairs were inserted or deleted meanwhile.  A scan starts with next_len
+ * 0.  The strings are not NUL-terminated.
+ */
+struct kv_mod_scan {
+	__u64 lo;       /* in:  user pointer to the first key, or the prefix */
+	__u64 hi;       /* in:  user pointer to the end key; 0 for no bound  */
+	__u64 buf;      /* in:  user pointer to where the pairs are stored   */
+	__u64 next;     /* in:  user pointer to KV_MOD_KEY_MAX bytes for the
+	                        key to resume at, or 0 if never resumed      */
+	__u64 stamp;    /* in:  the value of next to resume at;  out: ditto  */
+	__u32 lo_len;   /* in:  bytes at lo                                  */
+	__u32 hi_len;   /* in:  bytes at hi                                  */
+	__u32 buf_len;  /* in:  bytes available at buf;  out: bytes stored   */
+	__u32 flags;    /* in:  KV_MOD_SCAN_PREFIX;  out: KV_MOD_SCAN_MORE   */
+	__u32 next_len; /* in:  bytes at next, 0 to start at lo;  out: ditto */
+	__u32 count;    /* out: pairs stored                                 */
+};
+
+#define KV_MOD_SCAN_PREFIX  0x1
+#define KV_MOD_SCAN_MORE    0x2
+
+/*
+ * A lookup, as exchanged with KV_MOD_IOCXLOOKUP.  The file's cursor is moved
+ * to the caller's pair key val -- or, when val is 0, to the key's first value
+ * -- and the pair found there is stored in buf as a "key val\0" record, the
+ * same as read() returns.  The ioctl returns 1 if the pair was found and 0
+ * (with the cursor at the end) if not.  The strings are not NUL-terminated.
+ */
+struct kv_mod_lookup {
+	__u64 key;      /* in:  user pointer to the key                      */
+	__u64 val;      /* in:  user pointer to the value; 0 for any value   */
+	__u64 buf;      /* in:  user pointer to where the pair is stored, or
+	                        0 to only move the cursor                    */
+	__u32 klen;     /* in:  bytes at key                                 */
+	__u32 vlen;     /* in:  bytes at val                                 */
+	__u32 buf_len;  /* in:  bytes available at buf;  out: bytes stored   */
+	__u32 pad;
+};
+
+/*
+ * A pair, as exchanged with the binary ioctls KV_MOD_IOCXGET, KV_MOD_IOCSPUT
+ * and KV_MOD_IOCSDEL.  Keys and values are byte strings of explicit length,
+ * so they may hold spaces, newlines or NULs.  GET stores the key's first value
+ * at val; when it does not fit, nothing is stored, vlen is set to the length
+ * needed and the ioctl fails with EOVERFLOW.  A missing key or pair is ENOENT.
+ */
+struct kv_mod_pair {
+	__u64 key;      /* in:  user pointer to the key                      */
+	__u64 val;      /* in:  user pointer to the value (GET: where it is
+	                        stored)                                      */
+	__u32 klen;     /* in:  bytes at key                                 */
+	__u32 vlen;     /* in:  bytes at val;  GET out: bytes stored         */
+};
+
+/*
+ * All the values of a key, as exchanged with KV_MOD_IOCXGETALL.  Each value is
+ * stored in buf as a record: its length as a __u32, then its bytes, padded to
+ * KV_MOD_REC_ALIGN.  When buf fills, KV_MOD_SCAN_MORE is set and stamp is left
+ * at the first value not stored, so that calling again resumes there, as for
+ * a scan.  The first call passes stamp 0.
+ */
+struct kv_mod_vals {
+	__u64 key;      /* in:  user pointer to the key                      */
+	__u64 buf;      /* in:  user pointer to where the values are stored  */
+	__u64 stamp;    /* in:  the value to resume at;  out: ditto          */
+	__u32 klen;     /* in:  bytes at key                                 */
+	__u32 buf_len;  /* in:  bytes available at buf;  out: bytes stored   */
+	__u32 flags;    /* out: KV_MOD_SCAN_MORE                             */
+	__u32 count;    /* out: values stored                                */
+};
+
+/*
+ * A batch of operations, as exchanged with KV_MOD_IOCXBATCH.  ops points to
+ * count descriptors, which are run in order under one hold of the caller's
+ * lock, each setting its own result; the ioctl fails only if the batch as a
+ * whole cannot be run.  Keys and values are as for struct kv_mod_pair: GET
+ * stores the key's first value at val, PUT and DEL take the pair key val,
+ * and LOOKUP moves the file's cursor there (to the key's first value, when
+ * val is 0).
+ */
+struct kv_mod_op {
+	__u64 key;      /* in:  user pointer to the key                      */
+	__u64 val;      /* in:  user pointer to the value (GET: where it is
+	                        stored)                                      */
+	__u32 klen;     /* in:  bytes at key                                 */
+	__u32 vlen;     /* in:  bytes at val;  GET out: the value's length   */
+	__u32 op;       /* in:  KV_MOD_OP_*                                  */
+	__s32 result;   /* out: 0, or a negative errno                       */
+};
+
+struct kv_mod_batch {
+	__u64 ops;      /* in:  user pointer to the struct kv_mod_op array   */
+	__u32 count;    /* in:  descriptors at ops, at most KV_MOD_BATCH_MAX */
+	__u32 pad;
+};
+
+/*
+ * The submission and completion rings of a file, set up by KV_MOD_IOCTRING
+ * and then mapped with mmap().  The mapping begins with a struct kv_mod_ring
+ * giving where each ring lies in it.  User space posts a struct kv_mod_sqe at
+ * sq_tail and then advances sq_tail; KV_MOD_IOCTSUBMIT (the doorbell) runs the
+ * posted operations, as a batch would, and posts each one's struct kv_mod_cqe,
+ * carrying the caller's tag, at cq_tail.  KV_MOD_IOCTKICK rings the doorbell
+ * and returns at once, leaving the operations to a kernel worker; poll() then
+ * reports the file readable once completions are waiting.  User space
+ * consumes completions by advancing cq_head.  Indexes run freely and are
+ * masked by entries - 1; an operation is taken only while its completion has
+ * room.  The rings belong to the process that set them up: the operations run
+ * as its uid, and KV_MOD_IOCTSUBMIT and KV_MOD_IOCTKICK fail with EPERM from
+ * any other address space, such as a child's after fork().
+ */
+struct kv_mod_ring {
+	__u32 sq_head;  /* kernel: next submission to run                    */
+	__u32 sq_tail;  /* user:   next submission slot to fill              */
+	__u32 cq_head;  /* user:   next completion to consume                */
+	__u32 cq_tail;  /* kernel: next completion slot to fill              */
+	__u32 entries;  /* slots in each ring, a power of two                */
+	__u32 sq_off;   /* offset of the struct kv_mod_sqe array             */
+	__u32 cq_off;   /* offset of the struct kv_mod_cqe array             */
+	__u32 pad;
+};
+
+struct kv_mod_sqe {
+	__u64 tag;      /* returned in the operation's completion            */
+	__u64 key;      /* as for struct kv_mod_op                           */
+	__u64 val;
+	__u32 klen;
+	__u32 vlen;
+	__u32 op;       /* KV_MOD_OP_*                                       */
+	__u32 pad;
+};
+
+struct kv_mod_cqe {
+	__u64 tag;      /* the submission's tag                              */
+	__s32 result;   /* 0, or a negative errno                            */
+	__u32 vlen;     /* GET: the value's length                           */
+};
+
+#define KV_MOD_OP_GET     0
+#define KV_MOD_OP_PUT     1
+#define KV_MOD_OP_DEL     2
+#define KV_MOD_OP_LOOKUP  3
+
+#define KV_MOD_REC_ALIGN  4
+#define KV_MOD_REC_LEN(vlen) \
+	(((__u32) sizeof(__u32) + (vlen) + KV_MOD_REC_ALIGN - 1) & ~(KV_MOD_REC_ALIGN - 1))
+
+/*
+ * Ioctl definitions
+ */
+
+/* Use 'r' as magic number */
+#define KV_MOD_IOC_MAGIC  'r'
+#define KV_MOD_IOCRESET    _IO(KV_MOD_IOC_MAGIC,     0)
+
+/*
+ * S means "Set"       through a ptr,
+ * T means "Tell"      directly with the argument value
+ * G means "Get":      reply by setting through a pointer
+ * Q means "Query":    response is on the return value
+ * X means "eXchange": switch G and S atomically
+ * H means "sHift":    switch T and Q atomically
+ */
+#define KV_MOD_IOCSKEY _IOW (KV_MOD_IOC_MAGIC,   1, char)
+#define KV_MOD_IOCGSTATS _IOR(KV_MOD_IOC_MAGIC,  2, struct kv_mod_stats)
+#define KV_MOD_IOCXSCAN  _IOWR(KV_MOD_IOC_MAGIC, 3, struct kv_mod_scan)
+#define KV_MOD_IOCXLOOKUP _IOWR(KV_MOD_IOC_MAGIC, 4, struct kv_mod_lookup)
+#define KV_MOD_IOCTMODE  _IO(KV_MOD_IOC_MAGIC,   5)
+#define KV_MOD_IOCXGET   _IOWR(KV_MOD_IOC_MAGIC, 6, struct kv_mod_pair)
+#define KV_MOD_IOCSPUT   _IOW(KV_MOD_IOC_MAGIC,  7, struct kv_mod_pair)
+#define KV_MOD_IOCSDEL   _IOW(KV_MOD_IOC_MAGIC,  8, struct kv_mod_pair)
+#define KV_MOD_IOCXGETALL _IOWR(KV_MOD_IOC_MAGIC, 9, struct kv_mod_vals)
+#define KV_MOD_IOCXBATCH _IOWR(KV_MOD_IOC_MAGIC, 10, struct kv_mod_batch)
+#define KV_MOD_IOCTRING  _IO(KV_MOD_IOC_MAGIC,   11)
+#define KV_MOD_IOCTSUBMIT _IO(KV_MOD_IOC_MAGIC,  12)
+#define KV_MOD_IOCTKICK  _IO(KV_MOD_IOC_MAGIC,   13)
+#define KV_MOD_IOC_MAXNR 13
+
+#endif /* _KV_MOD_IOCTL_H_ */
@@ -0,0 +1,166 @@
+/* Purpose: Exercises the binary ioctls of the kv_mod device: KV_MOD_IOCSPUT,
+ *          KV_MOD_IOCXGET, KV_MOD_IOCXGETALL, KV_MOD_IOCSDEL,
+ *          KV_MOD_IOCXBATCH, KV_MOD_IOCXLOOKUP, KV_MOD_IOCGSTATS and, when
+ *          the device keeps its keys ordered, KV_MOD_IOCXSCAN.  The keys and
+ *          values hold spaces and NULs, which read() and write() cannot
+ *          carry.  Prints OK, or the first check that failed.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include "kv_mod_ioctl.h"
+
+#define PTR(p) ((__u64) (unsigned long) (p))
+
+#define CHECK(c) do { if (!(c)) { \
+	fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #c); \
+	return -1; } } while (0)
+
+static char key[] = "a key\0with a NUL";
+
+/* scan:  pages through the pairs whose keys begin with "t.", a few at a time */
+static int scan (int fd) {
+	struct kv_mod_scan s;
+	char               next[KV_MOD_KEY_MAX];
+	char               buf[32];
+	int                total = 0;
+
+	memset(&s, 0, sizeof(s));
+	s.lo     = PTR("t.");
+	s.lo_len = 2;
+	s.flags  = KV_MOD_SCAN_PREFIX;
+	s.next   = PTR(next);
+
+	do {
+		s.buf     = PTR(buf);
+		s.buf_len = sizeof(buf);
+		if (ioctl(fd, KV_MOD_IOCXSCAN, &s) == -1) {
+			if (errno == EOPNOTSUPP) {
+				printf("scan skipped: the device is not ordered\n");
+				return 0;
+			}
+			perror("scan");
+			return -1;
+		}
+		total += s.count;
+	} while (s.flags & KV_MOD_SCAN_MORE);
+
+	CHECK(total == 10);
+	return 0;
+}
+
+int main () {
+	struct kv_mod_pair   p;
+	struct kv_mod_vals   vs;
+	struct kv_mod_op     ops[3];
+	struct kv_mod_batch  b;
+	struct kv_mod_lookup lk;
+	struct kv_mod_stats  st;
+	char                 val[KV_MOD_VAL_MAX];
+	char                 rec[64];
+	char                 k[8];
+	int                  fd, i;
+
+	if ((fd = open ("/dev/kv_mod", O_RDWR)) == -1) {
+		perror("opening file");
+		return -1;
+	}
+
+	/* put two values of one key, and get back the first */
+	p.key  = PTR(key);
+	p.klen = sizeof(key);
+	p.val  = PTR("v 1");
+	p.vlen = 3;
+	CHECK(ioctl(fd, KV_MOD_IOCSPUT, &p) == 0);
+	p.val  = PTR("v\0002");
+	CHECK(ioctl(fd, KV_MOD_IOCSPUT, &p) == 0);
+
+	p.val  = PTR(val);
+	p.vlen = 1;
+	CHECK(ioctl(fd, KV_MOD_IOCXGET, &p) == -1 && errno == EOVERFLOW && p.vlen == 3);
+	p.vlen = sizeof(val);
+	CHECK(ioctl(fd, KV_MOD_IOCXGET, &p) == 0 && p.vlen == 3 && memcmp(val, "v 1", 3) == 0);
+
+	/* get both values, one record per call */
+	memset(&vs, 0, sizeof(vs));
+	vs.key  = PTR(key);
+	vs.klen = sizeof(key);
+	vs.buf  = PTR(rec);
+	for (i = 0; i < 2; i++) {
+		vs.buf_len = KV_MOD_REC_LEN(3);
+		CHECK(ioctl(fd, KV_MOD_IOCXGETALL, &vs) == 0 && vs.count == 1);
+		CHECK(*(__u32 *) rec == 3);
+	}
+	CHECK(!(vs.flags & KV_MOD_SCAN_MORE) && memcmp(rec + 4, "v\0002", 3) == 0);
+
+	/* a batch: put a pair, read it back and delete it */
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < 3; i++) {
+		ops[i].key  = PTR("batch");
+		ops[i].klen = 5;
+		ops[i].val  = PTR("b");
+		ops[i].vlen = 1;
+	}
+	ops[0].op   = KV_MOD_OP_PUT;
+	ops[1].op   = KV_MOD_OP_GET;
+	ops[1].val  = PTR(val);
+	ops[1].vlen = sizeof(val);
+	ops[2].op   = KV_MOD_OP_DEL;
+	b.ops   = PTR(ops);
+	b.count = 3;
+	b.pad   = 0;
+	CHECK(ioctl(fd, KV_MOD_IOCXBATCH, &b) == 0);
+	CHECK(ops[0].result == 0 && ops[1].result == 0 && ops[2].result == 0);
+	CHECK(ops[1].vlen == 1 && val[0] == 'b');
+
+	/* look up the first value of the key, moving the cursor there */
+	memset(&lk, 0, sizeof(lk));
+	lk.key     = PTR(key);
+	lk.klen    = sizeof(key);
+	lk.buf     = PTR(rec);
+	lk.buf_len = sizeof(rec);
+	CHECK(ioctl(fd, KV_MOD_IOCXLOOKUP, &lk) == 1);
+	CHECK(lk.buf_len == sizeof(key) + 1 + 3 + 1 && memcmp(rec + sizeof(key) + 1, "v 1", 3) == 0);
+	lk.key  = PTR("absent");
+	lk.klen = 6;
+	CHECK(ioctl(fd, KV_MOD_IOCXLOOKUP, &lk) == 0);
+
+	/* the totals count the key and its pairs */
+	CHECK(ioctl(fd, KV_MOD_IOCGSTATS, &st) == 0 && st.keys >= 1 && st.pairs >= 2);
+
+	/* ten keys under a prefix, for the scan */
+	for (i = 0; i < 10; i++) {
+		snprintf(k, sizeof(k), "t.%d", i);
+		p.key  = PTR(k);
+		p.klen = strlen(k);
+		p.val  = PTR("scan");
+		p.vlen = 4;
+		CHECK(ioctl(fd, KV_MOD_IOCSPUT, &p) == 0);
+	}
+	CHECK(scan(fd) == 0);
+
+	/* and remove what was put */
+	for (i = 0; i < 10; i++) {
+		snprintf(k, sizeof(k), "t.%d", i);
+		p.key  = PTR(k);
+		p.klen = strlen(k);
+		CHECK(ioctl(fd, KV_MOD_IOCSDEL, &p) == 0);
+	}
+	p.key  = PTR(key);
+	p.klen = sizeof(key);
+	p.val  = PTR("v 1");
+	p.vlen = 3;
+	CHECK(ioctl(fd, KV_MOD_IOCSDEL, &p) == 0);
+	CHECK(ioctl(fd, KV_MOD_IOCSDEL, &p) == -1 && errno == ENOENT);
+	p.val  = PTR("v\0002");
+	CHECK(ioctl(fd, KV_MOD_IOCSDEL, &p) == 0);
+
+	close(fd);
+	printf("OK\n");
+
+	return 0;
+}
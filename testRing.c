@@ -0,0 +1,137 @@
+/* Purpose: Exercises the submission rings of the kv_mod device.  The rings
+ *          are set up with KV_MOD_IOCTRING and mapped with mmap(); puts are
+ *          posted and run with the KV_MOD_IOCTSUBMIT doorbell, then gets
+ *          and deletes are posted and left to KV_MOD_IOCTKICK, whose
+ *          completions poll() waits for.  A child, in another address
+ *          space, may do neither.  Prints OK, or the first check that
+ *          failed.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "kv_mod_ioctl.h"
+
+#define ENTRIES 8
+#define PAIRS   4
+
+#define PTR(p) ((__u64) (unsigned long) (p))
+
+#define CHECK(c) do { if (!(c)) { \
+	fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #c); \
+	return -1; } } while (0)
+
+static char keys[PAIRS][8];
+static char vals[PAIRS][KV_MOD_VAL_MAX];
+
+/* post:  fills the next submission slot of ring r and makes it visible */
+static void post (struct kv_mod_ring *r, __u64 tag, __u32 op, int i) {
+	struct kv_mod_sqe *sq  = (struct kv_mod_sqe *) ((char *) r + r->sq_off);
+	struct kv_mod_sqe *sqe = &sq[r->sq_tail & (r->entries - 1)];
+
+	sqe->tag  = tag;
+	sqe->op   = op;
+	sqe->key  = PTR(keys[i]);
+	sqe->klen = strlen(keys[i]);
+	sqe->val  = PTR(vals[i]);
+	sqe->vlen = (op == KV_MOD_OP_GET) ? sizeof(vals[i]) : strlen(vals[i]);
+	sqe->pad  = 0;
+
+	/* the entry is written before the tail that publishes it */
+	__atomic_store_n(&r->sq_tail, r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* reap:  consumes the completions waiting in ring r, checking each one's
+ *        result; returns how many there were, or -1 on a failed check    */
+static int reap (struct kv_mod_ring *r, __u64 base) {
+	struct kv_mod_cqe *cq   = (struct kv_mod_cqe *) ((char *) r + r->cq_off);
+	__u32              tail = __atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE);
+	int                n    = 0;
+
+	for (; r->cq_head != tail; r->cq_head++, n++) {
+		struct kv_mod_cqe *cqe = &cq[r->cq_head & (r->entries - 1)];
+
+		CHECK(cqe->result == 0 && cqe->tag >= base && cqe->tag < base + PAIRS);
+	}
+
+	return n;
+}
+
+int main () {
+	struct kv_mod_ring *r;
+	struct pollfd       pfd;
+	long                size;
+	int                 fd, i, n;
+
+	if ((fd = open ("/dev/kv_mod", O_RDWR)) == -1) {
+		perror("opening file");
+		return -1;
+	}
+
+	/* a ring's size must be a power of two, and a file has one ring */
+	CHECK(ioctl(fd, KV_MOD_IOCTRING, 3) == -1 && errno == EINVAL);
+	CHECK(ioctl(fd, KV_MOD_IOCTSUBMIT, 0) == -1 && errno == ENXIO);
+	size = ioctl(fd, KV_MOD_IOCTRING, ENTRIES);
+	CHECK(size > 0);
+	CHECK(ioctl(fd, KV_MOD_IOCTRING, ENTRIES) == -1 && errno == EBUSY);
+
+	r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r == MAP_FAILED) {
+		perror("mapping rings");
+		return -1;
+	}
+	CHECK(r->entries == ENTRIES && r->sq_head == 0 && r->cq_tail == 0);
+
+	/* with no completions waiting, the file is not readable */
+	pfd.fd     = fd;
+	pfd.events = POLLIN;
+	CHECK(poll(&pfd, 1, 0) == 0);
+
+	/* post the puts, and ring the doorbell for them */
+	for (i = 0; i < PAIRS; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "r.%d", i);
+		snprintf(vals[i], sizeof(vals[i]), "value %d", i);
+		post(r, 100 + i, KV_MOD_OP_PUT, i);
+	}
+	CHECK(ioctl(fd, KV_MOD_IOCTSUBMIT, 0) == PAIRS);
+	CHECK(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+	CHECK(reap(r, 100) == PAIRS);
+
+	/* the gets are left to a kernel worker; wait for their completions */
+	for (i = 0; i < PAIRS; i++) {
+		memset(vals[i], 0, sizeof(vals[i]));
+		post(r, 200 + i, KV_MOD_OP_GET, i);
+	}
+	CHECK(ioctl(fd, KV_MOD_IOCTKICK, 0) == 0);
+	for (n = 0; n < PAIRS; n += i) {
+		CHECK(poll(&pfd, 1, 5000) == 1);
+		CHECK((i = reap(r, 200)) >= 0);
+	}
+	for (i = 0; i < PAIRS; i++) {
+		CHECK(strncmp(vals[i], "value ", 6) == 0 && vals[i][6] == '0' + i);
+	}
+
+	/* the rings serve only their creator: a child may not ring the bell */
+	if (fork() == 0) {
+		_exit(ioctl(fd, KV_MOD_IOCTSUBMIT, 0) == -1 && errno == EPERM &&
+		      ioctl(fd, KV_MOD_IOCTKICK, 0) == -1 && errno == EPERM ? 0 : 1);
+	}
+	CHECK(wait(&n) != -1 && WIFEXITED(n) && WEXITSTATUS(n) == 0);
+
+	/* and the deletes, in a single doorbell */
+	for (i = 0; i < PAIRS; i++) post(r, 300 + i, KV_MOD_OP_DEL, i);
+	CHECK(ioctl(fd, KV_MOD_IOCTSUBMIT, 0) == PAIRS);
+	CHECK(reap(r, 300) == PAIRS);
+
+	munmap(r, size);
+	close(fd);
+	printf("OK\n");
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+/* Purpose: Exercises stream mode on the kv_mod device.  KV_MOD_IOCTMODE puts
+ *          a file in KV_MOD_STREAM, in which a write() loads every "key val"
+ *          line of its buffer, a "- key val" line deleting that pair, and a
+ *          read() drains as many lines as fit; writev() runs a line on
+ *          across its segments.  Prints OK, or the first check that failed.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "kv_mod_ioctl.h"
+
+#define CHECK(c) do { if (!(c)) { \
+	fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #c); \
+	return -1; } } while (0)
+
+static const char load[] = "s.one 1\ns.two 2\ns.two 22\ns.three 3\n";
+static const char drop[] = "- s.one 1\n- s.two 2\n- s.two 22\n- s.three 3\n";
+
+/* count:  how many of the caller's lines starting with "s." a file opened in
+ *         stream mode drains, a fresh file's cursor being at the first pair */
+static int count (void) {
+	char    buf[4096];
+	char   *line;
+	ssize_t n;
+	int     fd, lines = 0;
+
+	if ((fd = open ("/dev/kv_mod", O_RDONLY)) == -1) return -1;
+
+	/* the stream is drained, a buffer of whole lines at a time */
+	if (ioctl(fd, KV_MOD_IOCTMODE, KV_MOD_STREAM) == 0) {
+		while ((n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+			buf[n] = '\0';
+			for (line = buf; line < buf + n; line = strchr(line, '\n') + 1) {
+				if (strncmp(line, "s.", 2) == 0) lines++;
+			}
+		}
+		if (n < 0) lines = -1;
+	} else {
+		lines = -1;
+	}
+
+	close(fd);
+	return lines;
+}
+
+int main () {
+	struct iovec split[2];
+	int          fd;
+
+	if ((fd = open ("/dev/kv_mod", O_RDWR)) == -1) {
+		perror("opening file");
+		return -1;
+	}
+
+	/* only the stream flag is a mode */
+	CHECK(ioctl(fd, KV_MOD_IOCTMODE, 0x2) == -1 && errno == EINVAL);
+	CHECK(ioctl(fd, KV_MOD_IOCTMODE, KV_MOD_STREAM) == 0);
+
+	/* a stream write takes the whole buffer, and returns bytes */
+	CHECK(write(fd, load, strlen(load)) == (ssize_t) strlen(load));
+	CHECK(count() == 4);
+
+	/* with writev, a line may run across segments, and the last needs no
+	   newline */
+	split[0].iov_base = "s.sp";
+	split[0].iov_len  = 4;
+	split[1].iov_base = "lit x";
+	split[1].iov_len  = 5;
+	CHECK(writev(fd, split, 2) == 9);
+	CHECK(count() == 5);
+
+	CHECK(write(fd, drop, strlen(drop)) == (ssize_t) strlen(drop));
+	CHECK(write(fd, "- s.split x\n", 12) == 12);
+	CHECK(count() == 0);
+
+	/* back in pair mode, each write() takes one pair and returns 1 */
+	CHECK(ioctl(fd, KV_MOD_IOCTMODE, 0) == 0);
+	CHECK(write(fd, "s.pair p", 9) == 1);
+	CHECK(ioctl(fd, KV_MOD_IOCTMODE, KV_MOD_STREAM) == 0);
+	CHECK(count() == 1);
+	CHECK(write(fd, "- s.pair p\n", 11) == 11);
+
+	close(fd);
+	printf("OK\n");
+
+	return 0;
+}